@@ -31,6 +31,7 @@ typedef uint32_t* bset32;
 #       define ctz              __builtin_ctzll
 #       define HAVE_CTZ
 #   endif
+#   define popcount         __builtin_popcountll
 #   define IsBitSet(x, i)   IsBitSet64(x, i)
 #   define SetBit(x, i)     SetBit64(x, i)
 #   define ClearBit(x, i)   ClearBit64(x, i)
@@ -44,6 +45,7 @@ typedef uint32_t* bset32;
 #       define ctz              __builtin_ctz
 #       define HAVE_CTZ
 #   endif
+#   define popcount         __builtin_popcount
 #   define IsBitSet(x, i)   IsBitSet32(x, i)
 #   define SetBit(x, i)     SetBit32(x, i)
 #   define ClearBit(x, i)   ClearBit32(x, i)
@@ -81,7 +83,7 @@ bset bset_alloc_many(int num_bits, int count)
             memset(mem, 0, count * len * sizeof(bset_int));
         return mem;
     } else {
-        return calloc(len, sizeof(bset_int));
+        return calloc(count * len, sizeof(bset_int));
     }
 }
 static void bset_free(bset bitset)
@@ -93,7 +95,7 @@ static void bset_free(bset bitset)
 #endif
 }
 
-static int issubset_bit(const bset sub, const bset super, size_t len)
+static inline int issubset_bit(const bset sub, const bset super, size_t len)
 {
     bset_int result = 0;
     for (int i = 0; i < len; i++) {
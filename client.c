@@ -11,7 +11,14 @@
 #include <unistd.h> //getopt
 #include <getopt.h> //getopt_long
 #include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
+#ifndef _WIN32
+#   include <sys/socket.h>
+#   include <sys/un.h> // handing the server our ring over a unix socket
+#endif
 #ifdef _WIN32
 #   include <fcntl.h> // open -- the mingw unix open
 #   include <sys/stat.h> //  permissions for _wopen
@@ -23,52 +30,238 @@
 #include "dbg.h"
 #include "fountainprotocol.h" // msg definitions
 #include "mapping.h" // map_file unmap_file
+#include "timing.h" // monotonic_usec
+#include "ring.h" // ring_s
+#include "shmring.h" // shmring_new shmring_peek
+#include "cpus.h" // online_cpus
+#include "sha256.h" // section_digest merkle_root
 
 #define DEFAULT_PORT 2534
 #define DEFAULT_IP "127.0.0.1"
 #define BURST_SIZE 1000
-#define NUM_CACHES 4
+#define INITIAL_WINDOW 4    /* sections requested at once, until we know */
+#define MAX_WINDOW 64
+
+#define EWMA_WEIGHT     0.125
+#define MIN_DELIVERY    0.05    /* don't let one lost burst blow up requests */
+#define INITIAL_RTO     100     /* ms to wait for a first packet, until we know */
+#define MIN_RTO         10
+#define MAX_TIMEOUT     15000
+#define MIN_GAP_TIMEOUT 5       /* ms of silence mid-burst before we decode */
+#define MAX_GAP_BACKOFF 8       /* doublings of that for a slowly paced burst */
+#define RANK_MARGIN     0.05    /* extra packets on top of those the decoder */
+#define RANK_MARGIN_MIN 2       /* says it needs, as some are dependent */
+#define WORKER_POLL_MS  50      /* how often an idle worker checks for shutdown */
+#define MAX_THREADS     64
+#define DIGEST_BATCH    64      /* digest requests in flight at once */
+#define SHM_RING_SIZE   (16 * 1024 * 1024) /* bytes of packets the server may
+                                              have put in our ring at once */
+#define GROUP_UNHEARD   1       /* the group has sent us nothing, returned
+                                   to start over without it */
+#define PIPELINE_MIN_RTT 10     /* ms of round trip it takes to be worth asking
+                                   for the next burst ahead of time */
 
 // ------ types ------
 
-typedef struct ftn_cache_s {
-    int capacity;
-    int size;
-    // should probably also have file ref in here
+/*
+ * A section gets a decoder when its first packet arrives. The decoder writes
+ * straight into the section's part of the output mapping and is freed again
+ * as soon as the section is decoded. Only the worker that owns the section
+ * ever touches the decoder, the counters are how it tells the main thread
+ * how far along the section is.
+ */
+typedef struct section_s {
+    memdecodestate_s* state;
+    _Atomic int decoded;
+    _Atomic int needed;     // independent packets still needed, -1 until known
+    _Atomic int queued;     // handed to the worker but not yet decoded
+    uint32_t seen;          // id after the last group symbol routed, only
+                            // touched by the main thread
+} section_s;
+
+/* A packet on its way from the main thread to a decode worker */
+typedef struct packet_slot_s {
+    int length;
     int section;
-    fountain_s** base;
-    fountain_s** current;
-    struct ftn_cache_s* next;
-} ftn_cache_s;
+    char data[];
+} packet_slot_s;
+
+/*
+ * A decode thread and the ring that feeds it. Packets are decoded in place
+ * in their ring slot, only ever copied out if the decoder has to hold them.
+ */
+typedef struct worker_s {
+    struct download_s* dl;
+    ring_s* ring;
+    void* block_set;    // scratch for the block set of the current packet
+    pthread_t thread;
+} worker_s;
+
+/*
+ * Everything we keep track of while the file downloads. The main thread
+ * receives, asks for more and hands each packet to the worker that owns its
+ * section, the one at section % num_workers. That way a slow decode step
+ * never leaves packets to overflow the socket buffer and sections decode in
+ * parallel without any locking around the decoders.
+ */
+typedef struct download_s {
+    char* file_mapping;
+    int num_sections;
+    int bytes_per_section;
+    int blk_size;
+    int filesize;
+    const uint8_t* digests; // SHA-256 of each section, NULL if not served
+    int first_undecoded;    // every section before this is decoded
+    section_s* sections;
+    int num_workers;
+    worker_s* workers;
+    _Atomic int num_decoded;
+    _Atomic int num_live;   // decoders currently allocated
+    _Atomic int num_late;   // packets a worker had no use for
+    _Atomic int num_failed; // sections that decoded to the wrong digest
+    _Atomic int error;      // set by a worker that had to give up
+    _Atomic uint64_t total_packets;
+    _Atomic int stop;
+} download_s;
 
 typedef struct stats_s {
     int num_requested;
     int num_recvd;
     int num_discarded;
+    int num_timeouts;
+    int num_corrupt;        // failed their checksum
+    int num_overflowed;     // arrived while their worker's ring was full
+    int num_failed;         // sections decoded again after failing their digest
+    /* The estimates below are moving averages that we size requests and
+       choose poll timeouts from */
+    double delivery;        // fraction of each request that arrives
+    double interarrival;    // usec between packets within a burst
+    double srtt;            // usec from sending a request to its first packet
+    double rttvar;
+    int gap_backoff;        // doublings of the gap timeout, while bursts are
+                            // paced too slowly for it
+    _Atomic double overhead; // packets the decoder needs per block in a
+                             // section, updated by the workers
 } stats_s;
 
+/*
+ * Where the packets we download come from: a socket, or the ring of shared
+ * memory we handed the server. The file info, digests and our requests
+ * always go over UDP.
+ */
+typedef struct transport_s {
+    /* a packet that is already here, NULL if we have to wait on poll_fd */
+    char* (*peek)(int* length);
+    /* readable once more packets may have come */
+    int (*poll_fd)(void);
+    /* once poll_fd is readable sets packet, NULL if there was none after
+       all, returns its length or < 0 on error */
+    int (*receive)(char** packet);
+    /* done with the packet from peek or receive */
+    void (*release)(void);
+    /* let go of it, packets come over UDP again */
+    void (*close)(void);
+} transport_s;
+
 // ------ Forward declarations ------
 static int proc_file(file_info_s* file_info);
 static int create_connection();
 static void close_connection();
-static fountain_s* get_ftn_from_network(int section, int num_sections);
 static int get_remote_file_info(struct file_info_s*);
+static void handle_pollevents(struct pollfd* pfd);
+static int listen_for_file_info(struct file_info_s*);
+static int get_remote_digests(struct file_info_s*);
+static int send_ring();
+static char* udp_peek(int* length);
+static int udp_poll_fd();
+static int udp_receive(char** packet);
+static int group_poll_fd();
+static int group_receive(char** packet);
+static void udp_release();
+#ifdef HAVE_SHMRING
+static char* shm_peek(int* length);
+static int shm_poll_fd();
+static int shm_receive(char** packet);
+static void shm_release();
+static void shm_close();
+#endif
+static int join_group(struct file_info_s*);
+static int leave_group(struct file_info_s*);
 static void platform_truncate(const char* filename, int length);
+static void load_token();
+static void save_token(uint32_t new_token);
 static char* sanitize_path(const char* unsafepath) __malloc;
 static int file_info_bytes_per_section(file_info_s* info);
 static int file_info_calc_num_sections(file_info_s* info);
 
 struct option long_options[] = {
     { "cachemul",   required_argument,  NULL, 'c' },
+    { "group",      required_argument,  NULL, 'g' },
     { "help",       no_argument,        NULL, 'h' },
     { "ip",         required_argument,  NULL, 'i' },
     { "output",     required_argument,  NULL, 'o' },
+    { "pipeline",   required_argument,  NULL, 'P' },
     { "port",       required_argument,  NULL, 'p' },
+    { "ring",       required_argument,  NULL, 'r' },
+    { "threads",    required_argument,  NULL, 't' },
+    { "token",      required_argument,  NULL, 'T' },
+    { "unicast",    no_argument,        NULL, 'u' },
+    { "unix",       required_argument,  NULL, 'U' },
+    { "window",     required_argument,  NULL, 'w' },
     { 0, 0, 0, 0 }
 };
 
 // ------ static variables ------
 static SOCKET s = INVALID_SOCKET;
+static SOCKET gs = INVALID_SOCKET; // the multicast group, if we are in one
+static int heard_group = 0; // anything has come through it
+static int unicast_only = 0;
+static char* listen_group = NULL; // a carousel to listen to, asking for nothing
+static int listen_group_port = 0;
+static int carousel = 0;  // the group streams every section without being asked
+static int server_takes_done = 0; // we may tell it which sections we have
+static uint32_t cookie = 0; // to show the server that we are who we say
+// The server's token for our address, kept in token_path between downloads so
+// that it can start on the next one from us in full
+static char* token_path = NULL;
+static uint32_t token = 0;
+// On the server's host it can put our packets in shared memory for us, if we
+// hand it a ring over its unix socket at shm_path
+static char* shm_path = NULL;
+static shmring_s* shm_ring = NULL;
+static const transport_s udp_transport = {
+    .peek = udp_peek,
+    .poll_fd = udp_poll_fd,
+    .receive = udp_receive,
+    .release = udp_release,
+    .close = udp_release
+};
+// what a group we joined sends us
+static const transport_s group_transport = {
+    .peek = udp_peek,
+    .poll_fd = group_poll_fd,
+    .receive = group_receive,
+    .release = udp_release,
+    .close = udp_release
+};
+#ifdef HAVE_SHMRING
+static const transport_s shm_transport = {
+    .peek = shm_peek,
+    .poll_fd = shm_poll_fd,
+    .receive = shm_receive,
+    .release = shm_release,
+    .close = shm_close
+};
+#endif
+static const transport_s* transport = &udp_transport;
+// The first sections we asked the server to start sending along with the file
+// info, and how many packets of them it did
+static struct {
+    int sections;
+    int overhead;       // permille of a section's blocks of each
+    uint64_t sent_at;
+    int started;
+} start_request = { };
 static int port = DEFAULT_PORT;
 static char* remote_addr = DEFAULT_IP;
 static char const * program_name = NULL;
@@ -79,10 +272,42 @@ static char * outfilename = NULL;
 static char* netbuf = NULL;
 static int netbuf_len;
 
+// What each section should hash to, checked against the file's Merkle root
+static uint8_t* section_digests = NULL;
+
 static int section_size_in_blocks = -1;
+// what the server chose
+static ftn_wire_s wire = { FTN_WIRE_V1, FTN_CHECKSUM_FLETCHER16 };
 static int cache_size_multiplier = 6;
-
-static stats_s stats = { };
+static int ring_slots = 4096;
+static int num_threads = 0;     // one per core besides the main thread
+static int max_window = 16;
+static int window_size = INITIAL_WINDOW;
+static int pipeline = 2;        // most requests outstanding at once
+
+// A request sent while the one before it was still arriving, for the next
+// round to receive
+static struct {
+    int n;
+    int sections[MAX_WINDOW];
+    int caps[MAX_WINDOW];
+} ahead = { };
+
+static stats_s stats = { .delivery = 1.0, .overhead = 1.2 };
+
+// How the last request we made is faring. Reported back to the server with
+// the next one so that it can pace its sending
+static struct {
+    int requested;
+    int received;
+    uint64_t sent_at;
+    uint64_t last_at;   // when the latest packet arrived
+    int delay;          // ms until the first packet arrived, 0 until then
+    int pipelined;      // sent while the one before was still arriving
+    int cut_short;      // we stopped waiting before all of it arrived
+    int stragglers;     // packets of the one before may still be arriving,
+                        // so its first packets tell us nothing of the delay
+} last_request = { };
 
 // ------ functions ------
 static void print_usage_and_exit(int status) {
@@ -92,10 +317,31 @@ static void print_usage_and_exit(int status) {
     fputs("\
 \n\
   -h, --help                display this help message\n\
-  -c, --cachemul=N          cache size as multiple of section size\n\
+  -c, --cachemul=N          most packets to request for a section, as a\n\
+                              multiple of section size\n\
+  -g, --group=IPADDRESS[:PORT]\n\
+                            listen to the server's carousel on this multicast\n\
+                              group without sending it anything, the port\n\
+                              is one above the server's by default. It is\n\
+                              joined on the interface that reaches --ip\n\
   -i, --ip=IPADDRESS        ip address of the remote host\n\
   -o, --output=FILENAME     output file name\n\
   -p, --port=PORT           port to connect to\n\
+  -P, --pipeline=N          most requests to have outstanding at once, the\n\
+                              next is sent while the last is still arriving\n\
+                              so that the link never waits on a round trip,\n\
+                              2 by default, 1 to wait for each to end\n\
+  -r, --ring=SLOTS          packets to buffer between receiving and decoding\n\
+  -t, --threads=N           decode threads, by default one per core\n\
+                              besides the receiving one\n\
+  -T, --token=FILE          keep the token the server gives our address in\n\
+                              FILE, so that it starts sending the next\n\
+                              download from it along with the file info\n\
+  -u, --unicast             never receive through a multicast group\n\
+  -U, --unix=PATH           hand the server, on this host, a ring of shared\n\
+                              memory over its unix socket at PATH for it to\n\
+                              put our packets in rather than send them\n\
+  -w, --window=N            most sections to request at once\n\
 ", out);
     exit(status);
 }
@@ -104,11 +350,21 @@ int main(int argc, char** argv) {
     /* deal with options */
     program_name = argv[0];
     int c;
-    while ( (c = getopt_long(argc, argv, "c:hi:o:p:", long_options, NULL)) != -1 ) {
+    while ( (c = getopt_long(argc, argv, "c:g:hi:o:p:P:r:t:T:uU:w:", long_options, NULL)) != -1 ) {
         switch (c) {
             case 'c':
                 cache_size_multiplier = atoi(optarg);
                 break;
+            case 'g':
+                listen_group = optarg;
+                {
+                    char* colon = strchr(optarg, ':');
+                    if (colon) {
+                        *colon = '\0';
+                        listen_group_port = atoi(colon + 1);
+                    }
+                }
+                break;
             case 'h':
                 print_usage_and_exit(0);
                 break;
@@ -121,6 +377,40 @@ int main(int argc, char** argv) {
             case 'p':
                 port = atoi(optarg);
                 break;
+            case 'P':
+                pipeline = atoi(optarg);
+                if (pipeline < 1) pipeline = 1;
+                break;
+            case 'r':
+                ring_slots = atoi(optarg);
+                if (ring_slots < 2) ring_slots = 2;
+                break;
+            case 't':
+                num_threads = atoi(optarg);
+                if (num_threads < 1) num_threads = 1;
+                if (num_threads > MAX_THREADS) num_threads = MAX_THREADS;
+                break;
+            case 'u':
+                unicast_only = 1;
+                break;
+            case 'T':
+                token_path = optarg;
+                break;
+            case 'U':
+#ifdef HAVE_SHMRING
+                // a group's packets could not go in our ring
+                shm_path = optarg;
+                unicast_only = 1;
+#else
+                log_err("Shared memory rings are not supported here");
+                print_usage_and_exit(1);
+#endif
+                break;
+            case 'w':
+                max_window = atoi(optarg);
+                if (max_window < 1) max_window = 1;
+                if (max_window > MAX_WINDOW) max_window = MAX_WINDOW;
+                break;
             case '?':
                 print_usage_and_exit(1);
                 break;
@@ -131,6 +421,12 @@ int main(int argc, char** argv) {
         }
     }
 
+    if (num_threads == 0) {
+        num_threads = online_cpus() - 1;
+        if (num_threads < 1) num_threads = 1;
+        if (num_threads > MAX_THREADS) num_threads = MAX_THREADS;
+    }
+
     int error;
     if ( (error = create_connection()) < 0 ) {
         close_connection();
@@ -151,29 +447,56 @@ int main(int argc, char** argv) {
 
     // define this above any jumps
     int i_should_free_outfilename = 0;
+    int exit_code = EXIT_FAILURE;
 
     // Let's "connect" our UDP socket to the remote address to
-    // simplify the code below
+    // simplify the code below. This sends nothing, so listening to a
+    // carousel we still do it to find the interface that reaches the server
     if (connect(s, (struct sockaddr*)&server_address, sizeof server_address) < 0) {
         log_err("Failed to connect UDP socket - wtf!");
         goto shutdown;
     }
 
     struct file_info_s file_info;
-    if (get_remote_file_info(&file_info) < 0) {
-        log_err("Failed to get information about the remote file");
-        goto shutdown;
+    if (listen_group) {
+        if ((error = listen_for_file_info(&file_info)) < 0) {
+            log_err("Failed to hear about the file from the carousel");
+            handle_error(error, NULL);
+            goto shutdown;
+        }
+    } else {
+        load_token();
+        if (get_remote_file_info(&file_info) < 0) {
+            log_err("Failed to get information about the remote file");
+            goto shutdown;
+        }
+        if (file_info.group && join_group(&file_info) < 0) {
+            log_err("Failed to join the multicast group");
+            goto shutdown;
+        }
+        if (shm_path && (error = send_ring()) < 0) {
+            log_warn("Unable to hand the server a ring, receiving over UDP");
+            handle_error(error, NULL);
+        }
     }
     debug("Downloading %s", file_info.filename);
     odebug("%d", file_info.section_size);
     odebug("%d", file_info.blk_size);
+    odebug("%d", file_info.checksum);
+    odebug("%d", file_info.version);
+    odebug("%d", carousel);
     if (file_info.blk_size > MAX_BLOCK_SIZE) {
         log_err("Block size (%"PRId16") larger than allowed: %d",
                   file_info.blk_size, MAX_BLOCK_SIZE);
     }
 
+    if ((error = get_remote_digests(&file_info)) < 0) {
+        handle_error(error, NULL);
+        goto shutdown;
+    }
+
     int to_alloc = 512;
-    while (to_alloc < file_info.blk_size + FTN_HEADER_SIZE + sizeof(uint16_t)) {
+    while (to_alloc < PACKED_FTN_SIZE(wire, file_info.blk_size)) {
         to_alloc <<= 1;
     }
     netbuf = malloc(to_alloc);
@@ -199,7 +522,15 @@ int main(int argc, char** argv) {
 
     section_size_in_blocks = file_info.section_size;
     // do { get some packets, try to decode } while ( not decoded )
-    if (proc_file(&file_info) < 0)
+    while ((error = proc_file(&file_info)) == GROUP_UNHEARD) {
+        if ((error = leave_group(&file_info)) < 0) {
+            log_err("Failed to start over without the group");
+            handle_error(error, NULL);
+            goto shutdown;
+        }
+        section_size_in_blocks = file_info.section_size;
+    }
+    if (error < 0)
         goto shutdown;
 
     platform_truncate(outfilename, file_info.filesize);
@@ -207,13 +538,23 @@ int main(int argc, char** argv) {
     odebug("%d", stats.num_requested);
     odebug("%d", stats.num_recvd);
     odebug("%d", stats.num_discarded);
+    odebug("%d", stats.num_timeouts);
+    odebug("%d", stats.num_corrupt);
+    odebug("%d", stats.num_overflowed);
+    odebug("%d", stats.num_failed);
+    log_info("delivery ratio %.3lf, inter-arrival %.0lf us, rtt %.0lf us, "
+             "decode overhead %.2lf", stats.delivery, stats.interarrival,
+             stats.srtt, stats.overhead);
+    exit_code = EXIT_SUCCESS;
 
 shutdown:
     if (i_should_free_outfilename)
         free(outfilename);
     if (netbuf)
         free(netbuf);
+    free(section_digests);
     close_connection();
+    return exit_code;
 }
 
 void platform_truncate(const char* filename, int length) {
@@ -324,6 +665,9 @@ int create_connection() {
 void close_connection() {
     if (s)
         closesocket(s);
+    if (gs != INVALID_SOCKET)
+        closesocket(gs);
+    transport->close();
     #ifdef _WIN32
     WSACleanup();
     #endif
@@ -341,12 +685,22 @@ static void file_info_order_from_network(file_info_s* info) {
     fp_from(info->section_size);
     fp_from(info->blk_size);
     fp_from(info->filesize);
+    fp_from(info->checksum);
+    fp_from(info->version);
+    fp_from(info->nonce);
+    fp_from(info->group_port);
+    fp_from(info->flags);
+    fp_from(info->cookie);
+    fp_from(info->start_packets);
+    fp_from(info->token);
 }
 
 static void wait_signal_order_for_network(wait_signal_s* wait_signal) {
     int n = wait_signal->num_sections;
     fp_to(wait_signal->magic);
     fp_to(wait_signal->num_sections);
+    fp_to(wait_signal->loss);
+    fp_to(wait_signal->delay);
     for (int i = 0; i < n; i++) {
         fp_to(wait_signal->sections[i].section);
         fp_to(wait_signal->sections[i].capacity);
@@ -354,15 +708,49 @@ static void wait_signal_order_for_network(wait_signal_s* wait_signal) {
 }
 
 
-static int send_wait_signal(int num_sections, int* sections, int* capacities) {
+/*
+ * Ask for capacities[i] packets of each sections[i]. In a group, say how far
+ * through the group's symbols of each we are so that the server can count
+ * what it has sent since. The server's cookie goes last.
+ */
+static int send_wait_signal(download_s* dl, int num_sections, int* sections,
+                            int* capacities, int in_flight) {
+    int total_requested = 0;
     for (int i = 0; i < num_sections; i++)
-        stats.num_requested += capacities[i];
-    int packet_size = sizeof(wait_signal_s) + num_sections * 2 * sizeof(uint16_t);
+        total_requested += capacities[i];
+    stats.num_requested += total_requested;
+    const int cookie_offset = (gs != INVALID_SOCKET)
+                              ? WAIT_SIGNAL_SEEN_SIZE(num_sections)
+                              : WAIT_SIGNAL_SIZE(num_sections);
+    int packet_size = cookie_offset + (cookie ? sizeof cookie : 0);
     wait_signal_s* msg = calloc(1, packet_size);
     check_mem(msg);
 
     msg->magic = MAGIC_WAITING;
     msg->num_sections = (uint16_t)num_sections;
+    // what is still on its way has been neither received nor lost
+    const int requested = last_request.requested - in_flight;
+    if (requested > 0) {
+        int received = last_request.received < requested
+                        ? last_request.received : requested;
+        msg->loss = 1000 * (requested - received) / requested;
+        msg->delay = last_request.delay;
+
+        double delivery = (double)received / requested;
+        stats.delivery += EWMA_WEIGHT * (delivery - stats.delivery);
+        if (stats.delivery < MIN_DELIVERY)
+            stats.delivery = MIN_DELIVERY;
+    }
+    last_request.requested = total_requested;
+    last_request.received = 0;
+    last_request.sent_at = monotonic_usec();
+    last_request.delay = 0;
+    // once pipelined, what arrived for a request may have been for the one
+    // before, so it may not be over when it seems to be
+    last_request.stragglers = in_flight > 0 || last_request.cut_short
+                              || last_request.pipelined;
+    last_request.pipelined = in_flight > 0;
+    last_request.cut_short = 0;
     for (int i = 0; i < num_sections; i++) {
         msg->sections[i].section = sections[i];
         msg->sections[i].capacity = capacities[i];
@@ -372,6 +760,17 @@ static int send_wait_signal(int num_sections, int* sections, int* capacities) {
         debug("Sending wait signal with capacity = %d", capacities[i]);
     }
     wait_signal_order_for_network(msg);
+    if (gs != INVALID_SOCKET) {
+        char* seen = (char*)msg + WAIT_SIGNAL_SIZE(num_sections);
+        for (int i = 0; i < num_sections; i++) {
+            uint32_t id = htonl(dl->sections[sections[i]].seen);
+            memcpy(seen + i * sizeof id, &id, sizeof id);
+        }
+    }
+    if (cookie) {
+        uint32_t echo = htonl(cookie);
+        memcpy((char*)msg + cookie_offset, &echo, sizeof echo);
+    }
     int result = send(s, (void*)msg, packet_size, 0);
     free(msg);
     return (result < 0) ? result : 0;
@@ -379,6 +778,49 @@ error:
     return ERR_MEM;
 }
 
+/* Move first_undecoded past the sections the workers have finished */
+static void download_skip_decoded(download_s* dl) {
+    while (dl->first_undecoded < dl->num_sections
+            && atomic_load(&dl->sections[dl->first_undecoded].decoded))
+        dl->first_undecoded++;
+}
+
+/*
+ * Tell the server which sections are decoded so that it stops sending them.
+ * Sections past the first undecoded one go as a bitmap up to the last that
+ * is decoded.
+ */
+static int send_done_signal(download_s* dl) {
+    if (!server_takes_done)
+        return 0;
+    download_skip_decoded(dl);
+    int first = dl->first_undecoded;
+    int num_bits = 0;
+    for (int i = 0; i < MAX_DONE_BITS && first + i < dl->num_sections; i++) {
+        if (atomic_load(&dl->sections[first + i].decoded))
+            num_bits = i + 1;
+    }
+    done_signal_s* msg = calloc(1, DONE_SIGNAL_SIZE(num_bits));
+    check_mem(msg);
+
+    msg->magic = MAGIC_DONE;
+    msg->first = first;
+    msg->num_bits = num_bits;
+    for (int i = 0; i < num_bits; i++) {
+        if (atomic_load(&dl->sections[first + i].decoded))
+            msg->bits[i / 8] |= 1 << (i % 8);
+    }
+    debug("Sending done signal from section %d", first);
+    packet_order_for_network((packet_s*)msg);
+    fp_to(msg->first);
+    fp_to(msg->num_bits);
+    int result = send(s, (void*)msg, DONE_SIGNAL_SIZE(num_bits), 0);
+    free(msg);
+    return (result < 0) ? result : 0;
+error:
+    return ERR_MEM;
+}
+
 static int recv_msg(char* buf, size_t buf_len) {
     memset(buf, '\0', buf_len);
     int bytes_recvd = recv(s, buf, buf_len, 0);
@@ -392,68 +834,385 @@ static int recv_msg(char* buf, size_t buf_len) {
 }
 
 static int send_file_info_request() {
+    // what we would ask for first anyway, for the server to send straight
+    // after the file info
+    start_request.sections = (window_size < max_window) ? window_size
+                                                        : max_window;
+    start_request.overhead = stats.overhead * 1000 + 0.5;
+    if (start_request.overhead > START_MAX_OVERHEAD)
+        start_request.overhead = START_MAX_OVERHEAD;
+    // so that the server can size blocks to fit the path
+    struct sockaddr_in server_address;
+    socklen_t address_size = sizeof server_address;
+    int mtu = (getpeername(s, (struct sockaddr*)&server_address,
+                           &address_size) == 0)
+              ? path_mtu(&server_address) : 0;
     info_request_s msg = {
         .magic = MAGIC_REQUEST_INFO,
+        .checksums = 1 << FTN_CHECKSUM_FLETCHER16 | 1 << FTN_CHECKSUM_CRC32C,
+        .versions = 1 << FTN_WIRE_V1 | 1 << FTN_WIRE_V2,
+        .flags = REQUEST_FLAG_NONCE
+                 | (unicast_only ? 0 : REQUEST_FLAG_MULTICAST
+                                       | REQUEST_FLAG_CAROUSEL),
+        .mtu = (mtu > UINT16_MAX) ? UINT16_MAX : mtu,
+        .start = start_request.sections,
+        .start_overhead = start_request.overhead,
+        .token = token,
     };
     packet_order_for_network((packet_s*)&msg);
-    int result = send(s, (void*)&msg, sizeof msg, 0);
+    fp_to(msg.checksums);
+    fp_to(msg.versions);
+    fp_to(msg.flags);
+    fp_to(msg.mtu);
+    fp_to(msg.start);
+    fp_to(msg.start_overhead);
+    fp_to(msg.token);
+    // the server starts on no more than the request's size allows
+    char padded[INFO_REQUEST_PADDED] = { };
+    memcpy(padded, &msg, sizeof msg);
+    start_request.sent_at = monotonic_usec();
+    int result = send(s, padded, sizeof padded, 0);
     return (result < 0) ? result : 0;
 }
 
+/*
+ * Check that the file info makes sense and take how packets are laid out
+ * from it
+ * returns 0 or an error code
+ */
+static int accept_file_info(file_info_s* file_info) {
+    // TODO: define max & min acceptable blocksizes and sanity check
+    // TODO: check
+    // blk_size * (num_blocks - 1) <= filesize <= blk_size * num_blocks ?
+    if (file_info->blk_size < 0
+            || file_info->filesize < 0
+            || (file_info->checksum != FTN_CHECKSUM_FLETCHER16
+                && file_info->checksum != FTN_CHECKSUM_CRC32C)
+            || file_info->version > FTN_WIRE_V2) {
+        log_err("Corrupt packet");
+        return ERR_NETWORK;
+    }
+    wire.checksum = file_info->checksum;
+    wire.version = (file_info->version == FTN_WIRE_V2)
+                   ? FTN_WIRE_V2 : FTN_WIRE_V1;
+    wire.nonce = file_info->nonce;
+    carousel = file_info->group && (file_info->flags & INFO_FLAG_CAROUSEL);
+    server_takes_done = !carousel && (file_info->flags & INFO_FLAG_DONE);
+    cookie = file_info->cookie;
+    save_token(file_info->token);
+    start_request.started = (!file_info->group
+                             && (file_info->flags & INFO_FLAG_STARTED))
+                            ? file_info->start_packets : 0;
+    return 0;
+}
+
+/*
+ * The token the server at remote_addr and port gave us last time, kept in
+ * token_path as a line of the address, the port and the token
+ */
+void load_token() {
+    FILE* f = token_path ? fopen(token_path, "r") : NULL;
+    if (!f)
+        return;
+    char address[64];
+    int saved_port;
+    uint32_t saved;
+    if (fscanf(f, "%63s %d %" SCNx32, address, &saved_port, &saved) == 3
+            && strcmp(address, remote_addr) == 0 && saved_port == port)
+        token = saved;
+    fclose(f);
+}
+
+void save_token(uint32_t new_token) {
+    if (!token_path || !new_token || new_token == token)
+        return;
+    token = new_token;
+    FILE* f = fopen(token_path, "w");
+    if (!f || fprintf(f, "%s %d %08" PRIx32 "\n", remote_addr, port, token) < 0)
+        log_warn("Unable to keep the server's token in %s", token_path);
+    if (f)
+        fclose(f);
+}
+
 int get_remote_file_info(file_info_s* file_info) {
-    int result = send_file_info_request();
-    if (result < 0) return result;
-
-    int bytes_recvd = recv_msg((char*)file_info, sizeof *file_info);
-    if (bytes_recvd < 0) return -1;
-    file_info_order_from_network(file_info);
-    if (file_info->magic == MAGIC_INFO) {
-        // TODO: define max & min acceptable blocksizes and sanity check
-        // TODO: check
-        // blk_size * (num_blocks - 1) <= filesize <= blk_size * num_blocks ?
-        if (file_info->blk_size < 0
-                || file_info->filesize < 0) {
-            log_err("Corrupt packet");
+    // A server with no session free or over its budget for new clients
+    // says nothing, so ask again, less often each time
+    const uint64_t start = monotonic_usec();
+    int timeout = INITIAL_RTO;
+    for (;;) {
+        int result = send_file_info_request();
+        if (result < 0) return result;
+
+        // Packets of the sections the server started on may overtake the
+        // file info, there is nothing we can do with them yet
+        struct pollfd pfd = { .fd = s, .events = POLLIN, .revents = 0 };
+        int pollret;
+        while ((pollret = poll(&pfd, 1, timeout)) > 0) {
+            int bytes_recvd = recv_msg((char*)file_info, sizeof *file_info);
+            if (bytes_recvd < 0) return -1;
+            file_info_order_from_network(file_info);
+            if (file_info->magic == MAGIC_INFO)
+                return accept_file_info(file_info);
+            debug("Packet was not a fileinfo packet");
+        }
+        if (pollret < 0 && errno != EINTR) {
+            log_err("Error when waiting for network activity");
+            handle_pollevents(&pfd);
             return ERR_NETWORK;
         }
-        return 0;
+        stats.num_timeouts++;
+        int left = MAX_TIMEOUT - (int)((monotonic_usec() - start) / 1000);
+        if (left <= 0) {
+            log_err("No file info after %.00lf seconds",
+                    (double)MAX_TIMEOUT / 1000.0);
+            return ERR_NETWORK;
+        }
+        timeout *= 2;
+        if (timeout > left)
+            timeout = left;
+        debug("No file info yet, asking again");
+    }
+}
+
+/*
+ * Join the group named on the command line and wait for its carousel to come
+ * round to the file info, without a word to the server
+ * returns 0 or an error code
+ */
+int listen_for_file_info(file_info_s* file_info) {
+    memset(file_info, 0, sizeof *file_info);
+    file_info->group = inet_addr(listen_group);
+    file_info->group_port = listen_group_port ? listen_group_port : port + 1;
+    int result = join_group(file_info);
+    if (result < 0)
+        return result;
+
+    struct pollfd pfd = { .fd = gs, .events = POLLIN, .revents = 0 };
+    int pollret;
+    while ((pollret = poll(&pfd, 1, MAX_TIMEOUT)) > 0) {
+        // Most of what comes is packets, which are too short or the wrong
+        // magic to be taken for a file info
+        int length = recv(gs, (char*)file_info, sizeof *file_info, 0);
+        if (length < (int)sizeof *file_info)
+            continue;
+        file_info_order_from_network(file_info);
+        if (file_info->magic == MAGIC_INFO
+                && (file_info->flags & INFO_FLAG_CAROUSEL))
+            return accept_file_info(file_info);
     }
-    log_err("Packet was not a fileinfo packet");
-    return -1;
+    if (pollret == 0)
+        log_err("Heard nothing from the carousel for %.00lf seconds",
+                (double)MAX_TIMEOUT / 1000.0);
+    return ERR_NETWORK;
 }
 
-static ftn_cache_s* ftn_cache_alloc(unsigned int num_caches) __malloc;
-ftn_cache_s* ftn_cache_alloc(unsigned int num_caches) {
-    assert(section_size_in_blocks > 0);
+/*
+ * Join the group the server sends our packets to, on the interface we reach
+ * the server through
+ * returns 0 or an error code
+ */
+int join_group(file_info_s* file_info) {
+    struct sockaddr_in local;
+    socklen_t local_size = sizeof local;
+    if (getsockname(s, (struct sockaddr*)&local, &local_size) < 0)
+        return ERR_NETWORK;
+
+    gs = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (gs == INVALID_SOCKET)
+        return ERR_NETWORK;
 
-    int capacity_each = cache_size_multiplier * section_size_in_blocks;
+    // Other receivers on this host listen on the same port
+    int one = 1;
+    setsockopt(gs, SOL_SOCKET, SO_REUSEADDR, (char*)&one, sizeof one);
+    struct sockaddr_in address = {
+        .sin_family = AF_INET,
+        .sin_port = htons(file_info->group_port),
+        .sin_addr.s_addr = htonl(INADDR_ANY)
+    };
+    struct ip_mreq mreq = {
+        .imr_multiaddr.s_addr = file_info->group,
+        .imr_interface = local.sin_addr
+    };
+    if (bind(gs, (struct sockaddr*)&address, sizeof address) < 0
+            || setsockopt(gs, IPPROTO_IP, IP_ADD_MEMBERSHIP, (char*)&mreq,
+                          sizeof mreq) < 0)
+        return ERR_NETWORK;
+    debug("Joined group %s:%d", inet_ntoa(mreq.imr_multiaddr),
+          file_info->group_port);
+    return 0;
+}
 
-    ftn_cache_s* caches = malloc(
-        num_caches * sizeof(*caches)
-        + num_caches * capacity_each * sizeof(*caches[0].base)
-    );
-    check_mem(caches);
-    // zero only the cache structs
-    memset(caches, 0, num_caches * sizeof *caches);
+/*
+ * Nothing has come through the group, maybe it does not reach us. Leave it
+ * and start over from a new port, which the server takes for a new client
+ * and sends to directly. The sections are the same bytes whatever the size
+ * of their blocks, so what we have of the file info and digests still holds.
+ * returns 0 or an error code
+ */
+int leave_group(file_info_s* file_info) {
+    log_warn("Nothing came through the group, asking to be sent to directly");
+    closesocket(gs);
+    gs = INVALID_SOCKET;
+    closesocket(s);
+    unicast_only = 1;
 
-    caches[0].base = (fountain_s**) &caches[num_caches];
-    for (int i = 1; i < num_caches; i++) {
-        caches[i].base = caches[0].base + i * capacity_each;
+    struct sockaddr_in server_address = {
+        .sin_family = AF_INET,
+        .sin_port   = htons(port),
+        .sin_addr.s_addr = inet_addr(remote_addr)
+    };
+    if (create_connection() < 0
+            || connect(s, (struct sockaddr*)&server_address,
+                       sizeof server_address) < 0)
+        return ERR_CONNECTION;
+
+    const int filesize = file_info->filesize;
+    const int bytes_per_section = file_info_bytes_per_section(file_info);
+    int result = get_remote_file_info(file_info);
+    if (result < 0)
+        return result;
+    if (file_info->filesize != filesize
+            || file_info_bytes_per_section(file_info) != bytes_per_section
+            || PACKED_FTN_SIZE(wire, file_info->blk_size) > netbuf_len) {
+        log_err("The file info changed when we asked again");
+        return ERR_INVALID;
+    }
+    transport->close();
+    if (shm_path && (result = send_ring()) < 0) {
+        log_warn("Unable to hand the server a ring, receiving over UDP");
+        handle_error(result, NULL);
     }
+    return 0;
+}
 
-    for (int i = 0; i < num_caches; i++) {
-        caches[i].capacity = capacity_each;
-        caches[i].section = -1;
-        caches[i].current = caches[i].base;
+/*
+ * Make a ring of shared memory and hand it to the server over its unix
+ * socket, with the address it knows us by and our cookie to show that it is
+ * for us. Until it has it the server goes on sending our packets.
+ * returns 0 or an error code
+ */
+int send_ring() {
+#ifdef HAVE_SHMRING
+    struct sockaddr_in local;
+    socklen_t local_size = sizeof local;
+    struct sockaddr_un server = { .sun_family = AF_UNIX };
+    if (getsockname(s, (struct sockaddr*)&local, &local_size) < 0)
+        return ERR_NETWORK;
+    if (strlen(shm_path) >= sizeof server.sun_path)
+        return ERR_INVALID;
+    strcpy(server.sun_path, shm_path);
+    shm_ring = shmring_new(SHM_RING_SIZE);
+    if (!shm_ring)
+        return ERR_MEM;
+
+    ring_request_s request = {
+        .magic = MAGIC_RING,
+        .address = local.sin_addr.s_addr,
+        .port = local.sin_port,
+        .cookie = cookie
+    };
+    fp_to(request.magic);
+    fp_to(request.cookie);
+    int fds[2] = { shmring_memfd(shm_ring), shmring_eventfd(shm_ring) };
+    char control[CMSG_SPACE(sizeof fds)];
+    memset(control, 0, sizeof control);
+    struct iovec iov = { .iov_base = &request, .iov_len = sizeof request };
+    struct msghdr msg = {
+        .msg_name = &server,
+        .msg_namelen = sizeof server,
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof control
+    };
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof fds);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof fds);
+
+    SOCKET us = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    int result = (us == INVALID_SOCKET || sendmsg(us, &msg, 0) < 0)
+                 ? ERR_NETWORK : 0;
+    if (us != INVALID_SOCKET)
+        closesocket(us);
+    if (result < 0) {
+        shmring_free(shm_ring);
+        shm_ring = NULL;
+    } else {
+        transport = &shm_transport;
+        debug("Handed the server a ring at %s", shm_path);
     }
+    return result;
+#else
+    return ERR_INVALID;
+#endif
+}
 
-    return caches;
-error:
-    if (caches)
-        free(caches);
+/* A socket never has a packet for us without being polled */
+char* udp_peek(int* length) {
     return NULL;
 }
 
+int udp_poll_fd() {
+    return s;
+}
+
+int udp_receive(char** packet) {
+    *packet = netbuf;
+    return recv(s, netbuf, netbuf_len, 0);
+}
+
+int group_poll_fd() {
+    return gs;
+}
+
+int group_receive(char** packet) {
+    *packet = netbuf;
+    int length = recv(gs, netbuf, netbuf_len, 0);
+    if (length >= 0)
+        heard_group = 1;
+    return length;
+}
+
+/* netbuf is ours again as soon as the packet is routed */
+void udp_release() {
+}
+
+#ifdef HAVE_SHMRING
+/*
+ * The oldest packet in the ring. With none there we tell the server that we
+ * are about to wait, unless one came in the meantime.
+ */
+char* shm_peek(int* length) {
+    char* packet = shmring_peek(shm_ring, length);
+    if (!packet && !shmring_sleep(shm_ring))
+        packet = shmring_peek(shm_ring, length);
+    return packet;
+}
+
+int shm_poll_fd() {
+    return shmring_eventfd(shm_ring);
+}
+
+int shm_receive(char** packet) {
+    int length = 0;
+    shmring_woken(shm_ring);
+    *packet = shmring_peek(shm_ring, &length);
+    return length;
+}
+
+void shm_release() {
+    shmring_release(shm_ring);
+}
+
+void shm_close() {
+    shmring_free(shm_ring);
+    shm_ring = NULL;
+    transport = &udp_transport;
+}
+#endif
+
 static void handle_pollevents(struct pollfd* pfd) {
     if (pfd->revents & POLLERR)
         log_err("POLLERR: An error has occurred");
@@ -465,189 +1224,726 @@ static void handle_pollevents(struct pollfd* pfd) {
 }
 
 
-typedef struct { int sections[NUM_CACHES]; int caps[NUM_CACHES]; } capacities_s;
-
-static capacities_s get_capacities(ftn_cache_s* cache, int num_sections) {
-    capacities_s result = { };
-    ftn_cache_s* c = cache;
-    for (int i = 0; i < num_sections; i++) {
-        result.sections[i] = c->section;
-        result.caps[i] = c->capacity - c->size;
-        c = c->next;
+/* Keep the moving averages up to date as packets arrive */
+static void note_packet_arrival(uint64_t now) {
+    if (last_request.received++ == 0 && !last_request.stragglers) {
+        double rtt = now - last_request.sent_at;
+        if (stats.srtt == 0) {
+            stats.srtt = rtt;
+            stats.rttvar = rtt / 2;
+        } else {
+            double err = rtt - stats.srtt;
+            stats.srtt += EWMA_WEIGHT * err;
+            stats.rttvar += 0.25 * ((err < 0 ? -err : err) - stats.rttvar);
+        }
+        int delay = rtt / 1000;
+        last_request.delay = delay > 0 ? delay : 1;
+    } else {
+        double gap = now - last_request.last_at;
+        stats.interarrival = (stats.interarrival == 0) ? gap
+                : stats.interarrival + EWMA_WEIGHT * (gap - stats.interarrival);
     }
-    return result;
+    last_request.last_at = now;
 }
 
-static void load_from_network(ftn_cache_s* cache, int num_sections) {
-    assert( num_sections <= NUM_CACHES ); // We can maybe increase this at some point
+/* ms to wait for the first packet of a request before asking again */
+static int request_timeout() {
+    if (stats.srtt == 0)
+        return INITIAL_RTO;
+    int rto = (stats.srtt + 4 * stats.rttvar) / 1000;
+    return (rto < MIN_RTO) ? MIN_RTO : (rto > MAX_TIMEOUT) ? MAX_TIMEOUT : rto;
+}
+
+/* ms of silence in the middle of a burst after which we go and decode */
+static int gap_timeout() {
+    int gap = 4 * stats.interarrival / 1000;
+    int rto = request_timeout();
+    gap = (gap < MIN_GAP_TIMEOUT) ? MIN_GAP_TIMEOUT : (gap > rto) ? rto : gap;
+    return gap << stats.gap_backoff;
+}
 
-    struct pollfd pfd = {
-        .fd = s,
-        .events = POLLIN,
-        .revents = 0
+static int send_digest_request(int first, int count) {
+    digest_request_s msg = {
+        .magic = MAGIC_REQUEST_DIGESTS,
+        .first = first,
+        .count = count,
+        .cookie = cookie,
     };
+    fp_to(msg.magic);
+    fp_to(msg.first);
+    fp_to(msg.count);
+    fp_to(msg.cookie);
+    int result = send(s, (void*)&msg, sizeof msg, 0);
+    return (result < 0) ? result : 0;
+}
 
-    int pollret1 = poll(&pfd, 1, 0);
-    if (pollret1 < 0) {
-        log_err("Error when waiting to receive packets");
-        return;
+static int is_zero(const uint8_t* bytes, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        if (bytes[i])
+            return 0;
     }
-    if (pollret1 > 0 && !(POLLIN & pfd.revents)) {
-        handle_pollevents(&pfd);
-        return;
+    return 1;
+}
+
+/*
+ * Fetch the digest of every section, asking again for those that went
+ * missing, and check them against the Merkle root in the file info. Leaves
+ * section_digests NULL if the server has no root for us. Listening to a
+ * carousel we cannot ask, so wait for it to come round to each of them.
+ * returns 0 or an error code
+ */
+int get_remote_digests(file_info_s* file_info) {
+    if (is_zero(file_info->merkle_root, sizeof file_info->merkle_root)) {
+        log_warn("The server sent no Merkle root, sections go unverified");
+        return 0;
     }
-    if (pollret1 == 0) {
-        capacities_s c = get_capacities(cache, num_sections);
-        // FIXME: check return code
-        send_wait_signal(num_sections, c.sections, c.caps);
-    }
-
-    static const int max_timeout = 15000;
-    int timeout = 10;
-    int null_ftn_cnt = 0;
-
-    int total_capacities = ({
-        int sum = 0;
-        capacities_s c = get_capacities(cache, num_sections);
-        for (int i = 0; i < num_sections; i++) { sum += c.caps[i]; }
-        sum;
-    });
-    for (int i = 0; i < total_capacities; i++) {
-        int pollret = poll(&pfd, 1, timeout);
-        if (pollret == 0) {
-            if (cache->size > 0) {
-                debug("Waited too long - time to decode instead");
-                break;
-            } else {
-                if (timeout / 2 >= max_timeout) {
-                    log_err("Timed out after %.00lf seconds",
-                            (double)max_timeout / 1000.0);
-                    return;
-                }
-                capacities_s c = get_capacities(cache, num_sections);
-                // FIXME: check return code
-                send_wait_signal(num_sections, c.sections, c.caps);
-                timeout <<= 1;
-                --i; // don't want to i++, so --i before continue
+
+    int num_sections = file_info_calc_num_sections(file_info);
+    int num_chunks = (num_sections + MAX_DIGESTS_PER_MSG - 1)
+                     / MAX_DIGESTS_PER_MSG;
+    int result = 0;
+    char* have = calloc(num_chunks, 1);
+    section_digests = malloc(num_sections * SHA256_SIZE + 1);
+    if (!have || !section_digests) {
+        result = ERR_MEM;
+        goto cleanup;
+    }
+
+    char buf[DIGESTS_SIZE(MAX_DIGESTS_PER_MSG)];
+    digests_s* reply = (digests_s*)buf;
+    int missing = num_chunks;
+    int timeout = request_timeout();
+    SOCKET from = listen_group ? gs : s;
+    // having started on the first sections the server has sent them all
+    int pushed = start_request.started;
+    while (missing > 0) {
+        for (int i = 0, sent = 0; !listen_group && !pushed
+                && i < num_chunks && sent < DIGEST_BATCH; i++) {
+            if (have[i])
                 continue;
-            }
-        } else if (pollret < 0) {
+            int first = i * MAX_DIGESTS_PER_MSG;
+            int count = num_sections - first;
+            if (count > MAX_DIGESTS_PER_MSG)
+                count = MAX_DIGESTS_PER_MSG;
+            if ((result = send_digest_request(first, count)) < 0)
+                goto cleanup;
+            sent++;
+        }
+
+        int was_missing = missing;
+        struct pollfd pfd = { .fd = from, .events = POLLIN, .revents = 0 };
+        int pollret;
+        while ((pollret = poll(&pfd, 1, timeout)) > 0) {
+            int length = recv(from, buf, sizeof buf, 0);
+            if (length < (int)sizeof *reply)
+                continue;
+            fp_from(reply->magic);
+            fp_from(reply->first);
+            fp_from(reply->count);
+            int first = reply->first, count = reply->count;
+            if (reply->magic != MAGIC_DIGESTS
+                    || length != DIGESTS_SIZE(count)
+                    || first % MAX_DIGESTS_PER_MSG != 0
+                    || first + count > num_sections
+                    || count != ((num_sections - first < MAX_DIGESTS_PER_MSG)
+                                 ? num_sections - first : MAX_DIGESTS_PER_MSG)
+                    || have[first / MAX_DIGESTS_PER_MSG])
+                continue;
+            memcpy(section_digests + first * SHA256_SIZE, reply->digests,
+                   count * SHA256_SIZE);
+            have[first / MAX_DIGESTS_PER_MSG] = 1;
+            if (--missing == 0)
+                break;
+        }
+        if (pollret < 0 && errno != EINTR) {
             log_err("Error when waiting for network activity");
-            cache->size = 0;
-            return;
-        } else if (!(POLLIN & pfd.revents)) {
-            log_err("Some networky problem...");
             handle_pollevents(&pfd);
-            cache->size = 0;
-            return;
+            result = ERR_NETWORK;
+            goto cleanup;
         }
-
-        int bytes_recvd = recv_msg(netbuf, netbuf_len);
-        if (bytes_recvd < 0) {
-            log_err("bytes_recvd < 0");// TODO: probs want proer error code
-            handle_error(bytes_recvd, NULL);
-            return;
+        pushed = 0;
+        if (missing == was_missing) {
+            stats.num_timeouts++;
+            if (timeout >= MAX_TIMEOUT) {
+                log_err("Timed out after %.00lf seconds",
+                        (double)MAX_TIMEOUT / 1000.0);
+                result = ERR_NETWORK;
+                goto cleanup;
+            }
+            timeout <<= 1;
+            if (timeout > MAX_TIMEOUT)
+                timeout = MAX_TIMEOUT;
         }
-        stats.num_recvd += 1;
+    }
 
-        buffer_s packet = {
-            .length = bytes_recvd,
-            .buffer = netbuf
-        };
-        fountain_s* ftn = unpack_fountain(packet, section_size_in_blocks);
-        if (ftn == NULL) { // Checksum may have failed
-            // If the system runs out of memory this may become an infinite
-            // loop... we could create an int offset instead of using
-            // i, but that may end the program if we get too many bad packets.
-            // Both are unlikely. May have to consider using some sort of
-            // error code instead
-            null_ftn_cnt += 1;
-            continue;
+    uint8_t root[SHA256_SIZE];
+    if ((result = merkle_root(section_digests, num_sections, root)) < 0)
+        goto cleanup;
+    if (memcmp(root, file_info->merkle_root, SHA256_SIZE) != 0)
+        result = ERR_VERIFY;
+    else
+        debug("Fetched the digests of %d sections", num_sections);
+
+cleanup:
+    free(have);
+    if (result < 0) {
+        free(section_digests);
+        section_digests = NULL;
+    }
+    return result;
+}
+
+/*
+ * Called by the workers once a section is decoded so that we learn how many
+ * packets the decoder needs per block. Two workers finishing at once may lose
+ * one of their updates, which a moving average can live with.
+ */
+static void note_section_decoded(int packets_required) {
+    double overhead = (double)packets_required / section_size_in_blocks;
+    double current = atomic_load(&stats.overhead);
+    atomic_store(&stats.overhead, current + 0.25 * (overhead - current));
+}
+
+/*
+ * Enough sections in flight to fill the pipe for a round trip, going by the
+ * rate packets have been arriving and how many a section takes
+ */
+static int choose_window(int sections_left) {
+    if (stats.srtt > 0 && stats.interarrival > 0) {
+        double packets_per_rtt = stats.srtt / stats.interarrival;
+        double packets_per_section = stats.overhead * section_size_in_blocks;
+        window_size = 1 + (int)(packets_per_rtt / packets_per_section + 0.5);
+    }
+    if (window_size > max_window)
+        window_size = max_window;
+    return (window_size < sections_left) ? window_size : sections_left;
+}
+
+static memdecodestate_s* section_decoder_new(download_s* dl, int section) {
+    decodestate_s* state = decodestate_new(dl->blk_size, section_size_in_blocks);
+    if (!state)
+        return NULL;
+
+    memdecodestate_s* mstate = realloc(state, sizeof *mstate);
+    if (!mstate) {
+        decodestate_free(state);
+        return NULL;
+    }
+    mstate->filename = memdecodestate_filename;
+    mstate->result = dl->file_mapping + (section * dl->bytes_per_section);
+    return mstate;
+}
+
+/*
+ * Hash the section where it was decoded into, while it is still in cache
+ * returns 1 if it matches the digest the server gave us or there was none
+ */
+static int download_verify(download_s* dl, int section) {
+    if (!dl->digests)
+        return 1;
+    size_t offset = (size_t)section * dl->bytes_per_section;
+    size_t length = dl->filesize - offset;
+    if (length > dl->bytes_per_section)
+        length = dl->bytes_per_section;
+    uint8_t digest[SHA256_SIZE];
+    section_digest(dl->file_mapping + offset, length, digest);
+    return memcmp(digest, dl->digests + section * SHA256_SIZE,
+                  SHA256_SIZE) == 0;
+}
+
+/*
+ * Decode the packet into its section straight away. Only ever called from the
+ * worker that owns the section.
+ * returns 1 if the packet was of no use to us, 0 if it was decoded and an
+ *         error code otherwise
+ */
+static int download_decode(download_s* dl, fountain_s* ftn) {
+    section_s* sec = dl->sections + ftn->section;
+    if (atomic_load(&sec->decoded)) {
+        debug("discarding fountain from section %d", ftn->section);
+        return 1;
+    }
+
+    if (!sec->state) {
+        // A carousel will not be back to a section we turn away for a whole
+        // turn, so we take them all
+        if (!carousel && atomic_load(&dl->num_live) >= 2 * max_window) {
+            debug("Too many sections in flight to start §%d", ftn->section);
+            return 1;
         }
-        // find cache for this section
-        ftn_cache_s* c;
-        for (c = cache; c != NULL; c = c->next) {
-            if (ftn->section == c->section) {
-                if (c->size < c->capacity) {
-                    c->base[c->size++] = ftn;
-                    break;
-                } else {
-                    debug("Cache for section %d is full", ftn->section);
-                }
-            }
+        sec->state = section_decoder_new(dl, ftn->section);
+        if (!sec->state)
+            return ERR_MEM;
+        atomic_fetch_add(&dl->num_live, 1);
+    }
+
+    sec->state->packets_so_far++;
+    int result = memdecode_fountain(sec->state, ftn);
+    if (result < 0)
+        return result;
+
+    if (decodestate_is_decoded(&sec->state->state)) {
+        int packets = sec->state->packets_so_far;
+        atomic_fetch_add(&dl->total_packets, packets);
+        decodestate_free(&sec->state->state);
+        sec->state = NULL;
+
+        if (!download_verify(dl, ftn->section)) {
+            // Start the section over, the controller will ask for it again
+            log_warn("Section %d does not match its digest", ftn->section);
+            atomic_fetch_add(&dl->num_failed, 1);
+            atomic_store(&sec->needed, -1);
+            atomic_fetch_sub(&dl->num_live, 1);
+            return 0;
         }
-        if (c == NULL) {
-            // Must be an old packet from a previous request
-            debug("discarding fountain from section %d", ftn->section);
-            free_fountain(ftn);
-            --i; // Since packet from previous request we don't count it
+        log_info("Packets required for section %d: %d", ftn->section, packets);
+        note_section_decoded(packets);
+
+        atomic_store(&sec->needed, 0);
+        atomic_store(&sec->decoded, 1);
+        atomic_fetch_sub(&dl->num_live, 1);
+        atomic_fetch_add(&dl->num_decoded, 1);
+    } else {
+        atomic_store(&sec->needed,
+                     decodestate_symbols_needed(&sec->state->state));
+    }
+    return 0;
+}
+
+/*
+ * Pick the undecoded sections to ask for and how many packets each. Ask for
+ * what we expect each still needs, less what its worker has yet to get
+ * through, scaled up by the loss we have been seeing. Sections that are
+ * underway have a decoder that can tell us exactly how far they are from
+ * being solved, for the rest we go by how many packets sections have taken
+ * so far.
+ * returns the number of sections chosen
+ */
+static int download_choose_request(download_s* dl, int* sections, int* caps) {
+    const int capacity = cache_size_multiplier * section_size_in_blocks;
+    download_skip_decoded(dl);
+
+    int n = choose_window(dl->num_sections - atomic_load(&dl->num_decoded));
+    int i = 0;
+    for (int section = dl->first_undecoded;
+            i < n && section < dl->num_sections; section++) {
+        section_s* sec = dl->sections + section;
+        if (atomic_load(&sec->decoded))
+            continue;
+        int needed = atomic_load(&sec->needed);
+        int wanted;
+        if (needed >= 0) {
+            wanted = needed + needed * RANK_MARGIN + RANK_MARGIN_MIN;
+        } else {
+            wanted = stats.overhead * section_size_in_blocks + 0.5;
         }
+        wanted -= atomic_load(&sec->queued);
+        if (wanted <= 0)
+            continue; // its worker should have all it needs
+        wanted = wanted / stats.delivery + 0.5;
+
+        sections[i] = section;
+        caps[i] = (wanted < capacity) ? wanted : capacity;
+        i++;
     }
-    ftn_cache_s* c = cache;
-    for (int i = 0; i < num_sections; i++) {
-        c->current = c->base;
-        debug("Cache %d size is now %d", i, c->size);
-        c = c->next;
-    }
-    if (cache->size == 0) {
-        debug("Returning with 0 sized cache");
-        log_info("null_ftn_cnt = %d", null_ftn_cnt);
-        __builtin_trap();
-    }
-}
-
-fountain_s* get_ftn_from_network(int section, int num_sections) {
-    static ftn_cache_s* cache = NULL;
-    if (cache == NULL) {
-        // in middle of switching to array of caches
-        cache = ftn_cache_alloc(NUM_CACHES);
-        if (cache == NULL)
-            return NULL;
-        for (int i = 0; i < NUM_CACHES - 1; i++) {
-            cache[i].next = cache + i + 1;
+    return i;
+}
+
+static int download_requested(int n, int* sections, int section) {
+    for (int i = 0; i < n; i++) {
+        if (sections[i] == section)
+            return 1;
+    }
+    return 0;
+}
+
+static int download_requested_decoded(download_s* dl, int n, int* sections) {
+    int decoded = 0;
+    for (int i = 0; i < n; i++)
+        decoded += atomic_load(&dl->sections[sections[i]].decoded);
+    return decoded;
+}
+
+static void* worker_main(void* arg) {
+    worker_s* w = arg;
+    download_s* dl = w->dl;
+
+    while (!atomic_load(&dl->stop)) {
+        packet_slot_s* slot = ring_peek(w->ring, WORKER_POLL_MS);
+        if (!slot)
+            continue;
+
+        int section = slot->section;
+        buffer_s packet = {
+            .length = slot->length,
+            .buffer = slot->data
+        };
+        fountain_s ftn;
+        int result = 1;
+        // a block size other than the file's would overrun the decoder
+        if (view_fountain(packet, wire, section_size_in_blocks,
+                          &ftn, w->block_set) == 0
+                && ftn.blk_size == dl->blk_size)
+            result = download_decode(dl, &ftn);
+        ring_release(w->ring);
+
+        atomic_fetch_sub(&dl->sections[section].queued, 1);
+        if (result == 1)
+            atomic_fetch_add(&dl->num_late, 1);
+        if (result < 0) {
+            atomic_store(&dl->error, result);
+            break;
         }
     }
+    return NULL;
+}
 
-    if (cache->section != section) {
-        debug("Throwing away %d packets", cache->size);
-        stats.num_discarded += cache->size;
-        while (cache->size > 0) {
-            fountain_s* to_delete = *cache->current;
-            *cache->current++ = NULL;
-            --cache->size;
-            free_fountain(to_delete);
+static void download_stop_workers(download_s* dl) {
+    atomic_store(&dl->stop, 1);
+    for (int i = 0; i < dl->num_workers; i++) {
+        pthread_join(dl->workers[i].thread, NULL);
+        ring_free(dl->workers[i].ring);
+        blockset_scratch_free(dl->workers[i].block_set);
+    }
+    free(dl->workers);
+    dl->workers = NULL;
+    dl->num_workers = 0;
+}
+
+static int download_start_workers(download_s* dl, int num_workers) {
+    int slots = ring_slots / num_workers;
+    dl->workers = calloc(num_workers, sizeof *dl->workers);
+    if (!dl->workers)
+        return ERR_MEM;
+
+    for (int i = 0; i < num_workers; i++) {
+        worker_s* w = dl->workers + i;
+        w->dl = dl;
+        w->ring = ring_new((slots < 2) ? 2 : slots,
+                           sizeof(packet_slot_s) + netbuf_len);
+        w->block_set = blockset_scratch_new(section_size_in_blocks);
+        if (!w->ring || !w->block_set)
+            goto free_worker;
+        if (pthread_create(&w->thread, NULL, worker_main, w) != 0) {
+            log_err("Failed to start decode worker %d", i);
+            goto free_worker;
         }
-        assert(cache->size == 0);
-        ftn_cache_s* c = cache;
-        cache = cache->next;
-        cache->section = section; // if cache-section == -1
-        c->section = -1;
-        ftn_cache_s** p = &cache;
-        while (*p != NULL) p = &(*p)->next; // p ends up pointing the null next pointer
-        *p = c;
-        c->next = NULL;
-    }
-
-    if (cache->size == 0) {
-        debug("Cache size 0 - loading §%d from network...", section);
-        int n_to_req = (num_sections - section > NUM_CACHES)
-                        ? NUM_CACHES : num_sections - section;
-        assert( n_to_req > 0 && n_to_req <= NUM_CACHES );
-        odebug("%d", n_to_req);
-        ftn_cache_s* c = cache;
-        for (int i = 0; i < n_to_req; i++) {
-            c->section = section + i;
-            c = c->next;
+        dl->num_workers++;
+    }
+    debug("Decoding on %d threads", num_workers);
+    return 0;
+free_worker: {
+    // the one that failed to start, the rest get stopped as usual
+    worker_s* w = dl->workers + dl->num_workers;
+    if (w->ring)
+        ring_free(w->ring);
+    if (w->block_set)
+        blockset_scratch_free(w->block_set);
+    }
+    download_stop_workers(dl);
+    return ERR_MEM;
+}
+
+/*
+ * Pass a packet on to the worker that owns its section, unless it is not one
+ * of ours or that section is already decoded
+ * returns 1, setting routed to its section if it went to a worker or to -1
+ */
+static int download_route(download_s* dl, char* data, int length,
+                          int from_group, int* routed) {
+    uint64_t now = monotonic_usec();
+    buffer_s packet = { .length = length, .buffer = data };
+    if (from_group && length >= sizeof(packet_s)) {
+        // A carousel's file info and digests come round among its packets
+        int32_t magic;
+        memcpy(&magic, data, sizeof magic);
+        magic = ntohl(magic);
+        if (magic == MAGIC_INFO || magic == MAGIC_DIGESTS)
+            return 1;
+    }
+    if (length > netbuf_len || !check_fountain(packet, wire)) {
+        stats.num_corrupt++;
+        return 1;
+    }
+    debug("Received %d bytes", length);
+    stats.num_recvd += 1;
+    note_packet_arrival(now);
+
+    int section = packed_fountain_section(packet, wire);
+    if (section < 0 || section >= dl->num_sections
+            || atomic_load(&dl->sections[section].decoded)) {
+        debug("discarding fountain from section %d", section);
+        stats.num_discarded++;
+        return 1;
+    }
+
+    worker_s* w = dl->workers + section % dl->num_workers;
+    packet_slot_s* slot = ring_claim(w->ring);
+    if (!slot) {
+        // The worker is too far behind, drop it here rather than leave the
+        // socket buffer to fill up
+        stats.num_overflowed++;
+        return 1;
+    }
+    slot->length = length;
+    slot->section = section;
+    memcpy(slot->data, data, length);
+    atomic_fetch_add(&dl->sections[section].queued, 1);
+    ring_publish(w->ring);
+    uint32_t id;
+    if (from_group && packed_fountain_symbol_id(packet, wire, &id) == 0
+            && (int32_t)(id + 1 - dl->sections[section].seen) > 0)
+        dl->sections[section].seen = id + 1;
+    *routed = section;
+    return 1;
+}
+
+/* Route a packet from a transport, and let it have its buffer back */
+static int download_take(download_s* dl, const transport_s* from,
+                         char* packet, int length, int* routed) {
+    int result = download_route(dl, packet, length, from == &group_transport,
+                                routed);
+    from->release();
+    return result;
+}
+
+/*
+ * Wait up to timeout ms for a packet and pass it on to the worker that owns
+ * its section. Packets already in our ring, if we have one, are taken first.
+ * returns 1 if a packet arrived, setting routed to its section if it went to a
+ *         worker or to -1, 0 if none did and an error code otherwise
+ */
+static int download_receive(download_s* dl, int timeout, int* routed) {
+    *routed = -1;
+    int length;
+    char* packet = transport->peek(&length);
+    if (packet)
+        return download_take(dl, transport, packet, length, routed);
+
+    // Packets come from the group if we are in one, but may still come
+    // straight from the server, over UDP until it has taken our ring
+    const transport_s* from[3] = { transport };
+    int nfds = 1;
+    if (transport != &udp_transport)
+        from[nfds++] = &udp_transport;
+    if (gs != INVALID_SOCKET)
+        from[nfds++] = &group_transport;
+    struct pollfd pfds[3];
+    for (int i = 0; i < nfds; i++)
+        pfds[i] = (struct pollfd) {
+            .fd = from[i]->poll_fd(), .events = POLLIN, .revents = 0
         };
-        load_from_network(cache, n_to_req);
 
-        if (cache->size == 0) return NULL;
+    int pollret = poll(pfds, nfds, timeout);
+    if (pollret == 0 || (pollret < 0 && errno == EINTR))
+        return 0;
+    int i = 0;
+    while (i < nfds && !(POLLIN & pfds[i].revents))
+        i++;
+    if (pollret < 0 || i == nfds) {
+        log_err("Error when waiting for network activity");
+        handle_pollevents(pfds);
+        return ERR_NETWORK;
+    }
+
+    length = from[i]->receive(&packet);
+    if (length < 0) {
+        log_err("Error reading from network");
+        return ERR_NETWORK;
+    }
+    if (!packet)
+        return 1;
+    return download_take(dl, from[i], packet, length, routed);
+}
+
+/* Packets handed to the workers for the sections but not yet decoded */
+static int download_queued(download_s* dl, int n, int* sections) {
+    int queued = 0;
+    for (int i = 0; i < n; i++)
+        queued += atomic_load(&dl->sections[sections[i]].queued);
+    return queued;
+}
+
+/*
+ * Wait in the first round for the sections the server started on with the
+ * file info, as though we had asked for them
+ */
+static void download_take_start(download_s* dl) {
+    const int capacity = START_CAPACITY(section_size_in_blocks,
+                                        start_request.overhead);
+    const int total = start_request.started;
+    ahead.n = 0;
+    for (int left = total; left > 0 && ahead.n < dl->num_sections
+            && ahead.n < MAX_WINDOW; ahead.n++) {
+        ahead.sections[ahead.n] = ahead.n;
+        ahead.caps[ahead.n] = (left < capacity) ? left : capacity;
+        left -= ahead.caps[ahead.n];
     }
+    stats.num_requested += total;
+    last_request.requested = total;
+    last_request.received = 0;
+    last_request.sent_at = start_request.sent_at;
+    last_request.delay = 0;
+    last_request.stragglers = 0;
+}
 
-    fountain_s* output = *cache->current;
-    *cache->current++ = NULL;
-    --cache->size;
-    return output;
+/*
+ * Ask for the next burst once what is still to come of this one would take
+ * less than pipeline - 1 round trips to arrive, so that the link does not go
+ * quiet while the request makes its way to the server. Requests are spaced
+ * so that no more than pipeline are on their way at once, and only sent while
+ * the rings have room for both bursts on top of what the workers have yet to
+ * decode.
+ * returns whether it asked
+ */
+static int download_pipeline(download_s* dl, int n, int* sections, int* caps,
+                             int to_come) {
+    if (pipeline < 2 || stats.srtt < PIPELINE_MIN_RTT * 1000
+            || stats.interarrival == 0
+            || to_come * stats.interarrival > (pipeline - 1) * stats.srtt
+            || (monotonic_usec() - last_request.sent_at) * (pipeline - 1)
+               < stats.srtt)
+        return 0;
+    int next = download_choose_request(dl, ahead.sections, ahead.caps);
+    // By the time the server has the request it will have sent what is still
+    // to come, which as it sends sections in the order asked for is of the
+    // last of them, so they need that much less
+    for (int j = n - 1, left = to_come; j >= 0 && left > 0; j--) {
+        int coming = (caps[j] < left) ? caps[j] : left;
+        left -= coming;
+        for (int i = 0; i < next; i++) {
+            if (ahead.sections[i] == sections[j])
+                ahead.caps[i] = (ahead.caps[i] > coming)
+                                ? ahead.caps[i] - coming : 0;
+        }
+    }
+    int next_total = 0;
+    for (int i = 0; i < next; i++)
+        next_total += ahead.caps[i];
+    if (next_total == 0 || download_queued(dl, n, sections) + to_come
+                           + next_total > ring_slots * dl->num_workers)
+        return 0;
+    // Unsent, the round goes on as though we had not tried
+    if (send_wait_signal(dl, next, ahead.sections, ahead.caps, to_come) < 0)
+        return 0;
+    ahead.n = next;
+    return 1;
+}
+
+/*
+ * Ask for a burst, unless we already have, and pass it on to the workers as
+ * it arrives. Returns once the burst is over, once everything it was for has
+ * been decoded or once we have asked for the next. From a carousel just take
+ * the next packet.
+ * returns 0, GROUP_UNHEARD if we should stop waiting on the group or an
+ *         error code
+ */
+static int download_round(download_s* dl) {
+    int routed;
+    if (carousel) {
+        // Nothing to ask for, the carousel comes round to every section
+        int result = download_receive(dl, MAX_TIMEOUT, &routed);
+        if (result == 0 && !heard_group && !listen_group)
+            return GROUP_UNHEARD;
+        if (result == 0) {
+            log_err("Heard nothing from the carousel for %.00lf seconds",
+                    (double)MAX_TIMEOUT / 1000.0);
+            return ERR_NETWORK;
+        }
+        return (result < 0) ? result : atomic_load(&dl->error);
+    }
+
+    int sections[MAX_WINDOW], caps[MAX_WINDOW];
+    const int pipelined = ahead.n > 0;
+    int n = ahead.n;
+    if (pipelined) {
+        memcpy(sections, ahead.sections, n * sizeof *sections);
+        memcpy(caps, ahead.caps, n * sizeof *caps);
+        ahead.n = 0;
+    } else {
+        n = download_choose_request(dl, sections, caps);
+    }
+    int total_capacities = 0;
+    for (int i = 0; i < n; i++)
+        total_capacities += caps[i];
+
+    if (total_capacities == 0) {
+        // The workers have all we expect they need, give them time to decode
+        int result = download_receive(dl, gap_timeout(), &routed);
+        return (result < 0) ? result : atomic_load(&dl->error);
+    }
+    // FIXME: check return code
+    if (!pipelined)
+        send_wait_signal(dl, n, sections, caps, 0);
+
+    int timeout = request_timeout();
+    int decoded = download_requested_decoded(dl, n, sections);
+
+    for (int received = 0; received < total_capacities; ) {
+        int result = download_receive(dl,
+                                      (received > 0) ? gap_timeout() : timeout,
+                                      &routed);
+        if (result < 0)
+            return result;
+        if ((result == 0 || routed >= 0) && atomic_load(&dl->error) < 0)
+            return atomic_load(&dl->error);
+        if (result == 0) {
+            if (received > 0) {
+                debug("Waited too long - time to ask again");
+                // Most of it still to come may just mean the server has slowed
+                // down to less than a packet a gap, reporting it all as lost
+                // would only slow it down further
+                if (2 * received < total_capacities) {
+                    if (stats.gap_backoff < MAX_GAP_BACKOFF)
+                        stats.gap_backoff++;
+                } else {
+                    stats.gap_backoff = 0;
+                }
+                last_request.cut_short = 1;
+                break;
+            }
+            stats.num_timeouts++;
+            // A member that has had nothing at all from the group for a
+            // whole RTO is unlikely to ever hear it
+            if (gs != INVALID_SOCKET && !heard_group)
+                return GROUP_UNHEARD;
+            if (timeout >= MAX_TIMEOUT) {
+                log_err("Timed out after %.00lf seconds",
+                        (double)MAX_TIMEOUT / 1000.0);
+                return ERR_NETWORK;
+            }
+            n = download_choose_request(dl, sections, caps);
+            // FIXME: check return code
+            send_wait_signal(dl, n, sections, caps, 0);
+            timeout <<= 1;
+            if (timeout > MAX_TIMEOUT)
+                timeout = MAX_TIMEOUT;
+            continue;
+        }
+        // Packets for decoded sections don't count, nor in a group do those
+        // for sections other members asked for
+        received += download_requested(n, sections, routed);
+
+        int now_decoded = download_requested_decoded(dl, n, sections);
+        if (now_decoded == n) {
+            // The rest was not lost, we just have no need to wait for it
+            if (last_request.received < last_request.requested) {
+                last_request.requested = last_request.received;
+                last_request.cut_short = 1;
+            }
+            break;
+        }
+        if (now_decoded > decoded) {
+            // so that the rest of the burst goes to the sections still open
+            decoded = now_decoded;
+            send_done_signal(dl);
+        }
+        if (routed >= 0
+                && download_pipeline(dl, n, sections, caps,
+                                     total_capacities - received))
+            break;
+    }
+    return 0;
 }
 
 int file_info_bytes_per_section(file_info_s* info)
@@ -661,7 +1957,7 @@ int file_info_calc_num_sections(file_info_s* info)
 }
 
 /* process fountains as they come down the wire
-   returns a status code (see errors.c)
+   returns a status code (see errors.c) or GROUP_UNHEARD
  */
 int proc_file(file_info_s* file_info) {
     int result = 0;
@@ -672,64 +1968,47 @@ int proc_file(file_info_s* file_info) {
         return handle_error(ERR_MAP, outfilename);
     }
 
-    uint64_t total_packets = 0;
-
-    int num_sections = file_info_calc_num_sections(file_info);
-    odebug("%d", num_sections);
-    int bytes_per_section = file_info_bytes_per_section(file_info);
-    odebug("%d", bytes_per_section);
-    for (int section_num = 0; section_num < num_sections; section_num++) {
-        decodestate_s* state =
-            decodestate_new(file_info->blk_size, file_info->section_size);
-        if (!state) {
-            __builtin_trap();
-            return handle_error(ERR_MEM, NULL);
-        }
-
-        // Have to declare this above the first goto cleanup
-        fountain_s* ftn = NULL;
-
-        memdecodestate_s* tmp_ptr = realloc(state, sizeof(memdecodestate_s));
-        if (tmp_ptr) {
-            state = (decodestate_s*)tmp_ptr;
-        } else {
-            result = ERR_MEM;
-            __builtin_trap();
-            goto cleanup;
-        }
-
-        state->filename = memdecodestate_filename;
-
-        ((memdecodestate_s*)state)->result = file_mapping + (section_num * bytes_per_section);
-
-        do {
-            ftn = get_ftn_from_network(section_num, num_sections);
-            if (!ftn)  {
-                __builtin_trap(); // Hopefully core dump when this goes funny
-                goto cleanup;
-            }
-            state->packets_so_far++;
-            result = memdecode_fountain((memdecodestate_s*)state, ftn);
-            free_fountain(ftn);
-            if (result < 0) {
-                __builtin_trap(); // Hopefully core dump when this goes funny
-                goto cleanup;
-            }
-        } while (!decodestate_is_decoded(state));
-
-        log_info("Packets required for section %d: %d", section_num, state->packets_so_far);
-        total_packets += state->packets_so_far;
-cleanup:
-        if (state)
-            decodestate_free(state);
-        if (result < 0 || !ftn) {
-            __builtin_trap(); // Hopefully core dump when this goes funny
+    download_s dl = {
+        .file_mapping = file_mapping,
+        .num_sections = file_info_calc_num_sections(file_info),
+        .bytes_per_section = file_info_bytes_per_section(file_info),
+        .blk_size = file_info->blk_size,
+        .filesize = file_info->filesize,
+        .digests = section_digests,
+    };
+    odebug("%d", dl.num_sections);
+    odebug("%d", dl.bytes_per_section);
+    dl.sections = calloc(dl.num_sections, sizeof *dl.sections);
+    if (!dl.sections) {
+        result = ERR_MEM;
+        goto cleanup;
+    }
+    for (int i = 0; i < dl.num_sections; i++)
+        dl.sections[i].needed = -1;
+
+    if ((result = download_start_workers(&dl, num_threads)) < 0)
+        goto free_sections;
+    if (start_request.started)
+        download_take_start(&dl);
+    while (atomic_load(&dl.num_decoded) < dl.num_sections) {
+        if ((result = download_round(&dl)) != 0)
             break;
-        }
     }
-    log_info("Total packets required for download: %"PRIu64, total_packets);
-
+    download_stop_workers(&dl);
+    if (result == 0)
+        send_done_signal(&dl);  // the server can let our session go
+    stats.num_discarded += dl.num_late;
+    stats.num_failed = dl.num_failed;
+    log_info("Total packets required for download: %"PRIu64,
+             (uint64_t)dl.total_packets);
+
+    for (int i = 0; i < dl.num_sections; i++) {
+        if (dl.sections[i].state)
+            decodestate_free(&dl.sections[i].state->state);
+    }
+free_sections:
+    free(dl.sections);
+cleanup:
     if (file_mapping) unmap_file(file_mapping);
-    return handle_error(result, err_str);
+    return (result == GROUP_UNHEARD) ? result : handle_error(result, err_str);
 }
-
@@ -0,0 +1,24 @@
+#ifndef __CPUS_H__
+#define __CPUS_H__
+
+#ifdef _WIN32
+#   define WIN32_LEAN_AND_MEAN
+#   include <windows.h>
+#else
+#   include <unistd.h>
+#endif
+
+/* The number of processors we can spread work over, at least 1 */
+static inline int online_cpus(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return (n > 0) ? n : 1;
+#endif
+}
+
+#endif /* __CPUS_H__ */
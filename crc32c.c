@@ -0,0 +1,119 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "crc32c.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#   include <x86intrin.h>
+#   define HAVE_SSE42_DISPATCH
+#elif defined(__ARM_FEATURE_CRC32)
+#   include <arm_acle.h>
+#endif
+
+#define POLY 0x82f63b78 /* reversed Castagnoli polynomial */
+
+static uint32_t table[8][256];
+
+static uint32_t (*crc32c_impl)(uint32_t, const void*, size_t) = crc32c_sw;
+
+/* Slicing-by-8: eight table lookups per 8 bytes rather than one per byte */
+uint32_t crc32c_sw(uint32_t crc, const void* data, size_t length) {
+    const unsigned char* p = data;
+    crc = ~crc;
+    while (length && ((uintptr_t)p & 7)) {
+        crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        length--;
+    }
+    while (length >= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof word);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        word = __builtin_bswap64(word);
+#endif
+        word ^= crc;
+        crc = table[7][word & 0xff]
+            ^ table[6][(word >> 8) & 0xff]
+            ^ table[5][(word >> 16) & 0xff]
+            ^ table[4][(word >> 24) & 0xff]
+            ^ table[3][(word >> 32) & 0xff]
+            ^ table[2][(word >> 40) & 0xff]
+            ^ table[1][(word >> 48) & 0xff]
+            ^ table[0][word >> 56];
+        p += 8;
+        length -= 8;
+    }
+    while (length--)
+        crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+#ifdef HAVE_SSE42_DISPATCH
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const void* data, size_t length) {
+    const unsigned char* p = data;
+    crc = ~crc;
+    while (length && ((uintptr_t)p & 7)) {
+        crc = _mm_crc32_u8(crc, *p++);
+        length--;
+    }
+#   ifdef __x86_64__
+    uint64_t crc64 = crc;
+    for (; length >= 8; p += 8, length -= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof word);
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = (uint32_t)crc64;
+#   endif
+    for (; length >= 4; p += 4, length -= 4) {
+        uint32_t word;
+        memcpy(&word, p, sizeof word);
+        crc = _mm_crc32_u32(crc, word);
+    }
+    while (length--)
+        crc = _mm_crc32_u8(crc, *p++);
+    return ~crc;
+}
+#elif defined(__ARM_FEATURE_CRC32)
+static uint32_t crc32c_arm(uint32_t crc, const void* data, size_t length) {
+    const unsigned char* p = data;
+    crc = ~crc;
+    for (; length >= 8; p += 8, length -= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof word);
+        crc = __crc32cd(crc, word);
+    }
+    while (length--)
+        crc = __crc32cb(crc, *p++);
+    return ~crc;
+}
+#endif
+
+/* Build the tables and pick the fastest implementation before main runs */
+__attribute__((constructor))
+static void crc32c_init(void) {
+    for (int i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int j = 0; j < 8; j++)
+            crc = (crc >> 1) ^ (POLY & -(crc & 1));
+        table[0][i] = crc;
+    }
+    for (int i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++)
+            table[t][i] = table[0][table[t - 1][i] & 0xff]
+                        ^ (table[t - 1][i] >> 8);
+    }
+
+#ifdef HAVE_SSE42_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))
+        crc32c_impl = crc32c_sse42;
+#elif defined(__ARM_FEATURE_CRC32)
+    crc32c_impl = crc32c_arm;
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void* data, size_t length) {
+    return crc32c_impl(crc, data, length);
+}
@@ -0,0 +1,18 @@
+#ifndef __CRC32C_H__
+#define __CRC32C_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * CRC-32C (Castagnoli), as used by iSCSI and SCTP. Uses the crc32
+ * instruction where the CPU has one and slicing-by-8 tables otherwise.
+ *
+ * Start with crc = 0 and pass the result back in to continue over data that
+ * comes in pieces.
+ */
+uint32_t crc32c(uint32_t crc, const void* data, size_t length);
+/* The same from the tables alone, whatever the CPU has */
+uint32_t crc32c_sw(uint32_t crc, const void* data, size_t length);
+
+#endif /* __CRC32C_H__ */
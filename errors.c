@@ -40,6 +40,9 @@ int handle_error(int error_number, const void* args) {
         case ERR_CONNECTION:
             pe("An error occurred trying create the socket" ENDL);
             break;
+        case ERR_NETWORK:
+            pe("An error occurred receiving from the network" ENDL);
+            break;
         case ERR_INVALID:
             pe("An invalid (not corrupt) fountain was send to the program");
             break;
@@ -49,6 +52,9 @@ int handle_error(int error_number, const void* args) {
         case ERR_SEND:
             pe("An error occurred sending");
             break;
+        case ERR_VERIFY:
+            pe("The section digests do not match the file's Merkle root" ENDL);
+            break;
         default:
             return 0;
     }
@@ -7,6 +7,7 @@
 #include <stdint.h>
 #include <inttypes.h>
 #include <stdbool.h>
+#include <stddef.h> // offsetof
 #include <math.h>
 #include <assert.h>
 #ifdef __x86_64__
@@ -19,6 +20,15 @@
 #include "dbg.h"
 #include "randgen.h"
 #include "bitset.h"
+#include "crc32c.h"
+#ifdef UNIT_TESTS
+#   include <unistd.h> // close
+#   include "ring.h"
+#   include "sha256.h"
+#   include "shmring.h"
+#   include "symcache.h"
+#   include "store.h"
+#endif
 
 #define ISBITSET(x, i) (( (x)[(i)>>3] & (1<<((i)&7)) ) != 0)
 #define SETBIT(x, i) (x)[(i)>>3] |= (1<<((i)&7))
@@ -78,14 +88,23 @@ static int size_in_blocks(int string_len, int blk_size) {
 }
 
 /*
+ * The number of blocks in a packet, worked out from its seed so that it need
+ * not be sent along with it
  * param n = filesize in blocks
  */
-static int choose_num_blocks(const int n) {
+static int seeded_num_blocks(const int n, uint64_t seed) {
+    // Scramble the seed so that nearby seeds get unrelated degrees
+    uint32_t h = (uint32_t)seed * 0x9e3779b1u;
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
     // Effectively uniform random double between 0 and 1
-    double x = (double)rand() / (double)RAND_MAX;
+    double x = (double)h / (double)UINT32_MAX;
     // Distribute to make smaller blocks more common
     double d = (double)n * (x <= 0.5 ? x*x*x : 1 - x*x*x);
-    // Windows might pick rand()==RAND_MAX, so min these
+    // x might come out as exactly 1, so min these
     return min(1 + (int)floor(d), n);
 }
 
@@ -112,13 +131,12 @@ static void seeded_select_blocks(int* blocks, int n, int d, uint64_t seed) {
 }
 
 /*
- * Same as seeded_select_blocks but creates a bitset rather than an array of
+ * Same as seeded_select_blocks but fills in a bitset rather than an array of
  * the block numbers
  */
-static bset seeded_select_blockset(int n, int d, uint64_t seed) {
+static void seeded_fill_blockset(bset block_set, int n, int d, uint64_t seed) {
     assert( d <= n );
-    bset block_set = bset_alloc(n);
-    check_mem(block_set);
+    memset(block_set, 0, bset_len(n) * sizeof *block_set);
 
     for (int i = 0; i < d; i++) {
         randgen_s gen = next_rand(seed);
@@ -130,9 +148,32 @@ static bset seeded_select_blockset(int n, int d, uint64_t seed) {
         else
             SetBit(block_set, block_num);
     }
+}
+
+static bset seeded_select_blockset(int n, int d, uint64_t seed) {
+    bset block_set = bset_alloc(n);
+    if (block_set)
+        seeded_fill_blockset(block_set, n, d, seed);
     return block_set;
-error:
-    return NULL;
+}
+
+/* A bijection on the low 31 bits, which are all that next_rand looks at */
+static uint32_t mix31(uint32_t h) {
+    const uint32_t mask = 0x7fffffff;
+    h &= mask;
+    h ^= h >> 16;
+    h = (h * 0x85ebca6bu) & mask;
+    h ^= h >> 13;
+    h = (h * 0xc2b2ae35u) & mask;
+    h ^= h >> 16;
+    return h;
+}
+
+uint64_t symbol_seed(uint32_t nonce, int section, uint32_t symbol_id) {
+    if (!nonce) // servers from before nonces sent the seed as the id
+        return symbol_id;
+    uint32_t key = mix31(nonce ^ mix31(section + 1));
+    return (uint64_t)nonce << 32 | mix31(symbol_id + key);
 }
 
 // For our sorting of the block_list before reading the file in fmake_fountain
@@ -156,9 +197,9 @@ fountain_s* fmake_fountain(FILE* f, int blk_size, int section, int section_size)
     output->section = section;
 
     int n = section_size; // Always
-    output->num_blocks = choose_num_blocks(n);
-    assert( output->num_blocks > 0 );
     output->seed = rand();
+    output->num_blocks = seeded_num_blocks(n, output->seed);
+    assert( output->num_blocks > 0 );
     int block_list[output->num_blocks];
     seeded_select_blocks(block_list, n, output->num_blocks, output->seed);
 
@@ -207,51 +248,71 @@ free_ftn:
     return NULL;
 }
 
-fountain_s* make_fountain(const char* string, int blk_size, size_t length, int section, int section_size) {
-    int bytes_per_section = blk_size * section_size;
-    int offset = section * bytes_per_section;
+void encode_fountain(fountain_s* ftn, char* scratch, const char* string,
+        int blk_size, size_t length, int section, int section_size,
+        uint32_t nonce, uint32_t symbol_id) {
+    size_t offset = (size_t)section * blk_size * section_size;
 
-    fountain_s* output = malloc(sizeof *output);
-    if (output == NULL) return NULL;
-
-    memset(output, 0, sizeof *output);
-
-    output->blk_size = blk_size;
-    output->section = section;
+    *ftn = (fountain_s) {
+        .blk_size = blk_size,
+        .section = section,
+        .symbol_id = symbol_id
+    };
 
     int n = section_size;
-    output->num_blocks = choose_num_blocks(n);
-    assert( output->num_blocks > 0 );
-    output->seed = rand();
+    ftn->seed = symbol_seed(nonce, section, symbol_id);
+    ftn->num_blocks = seeded_num_blocks(n, ftn->seed);
+    assert( ftn->num_blocks > 0 );
 
-    int block_list[output->num_blocks];
-    seeded_select_blocks(block_list, n, output->num_blocks, output->seed);
+    int block_list[ftn->num_blocks];
+    seeded_select_blocks(block_list, n, ftn->num_blocks, ftn->seed);
     // sort to make block reading sequential
-    qsort(block_list, output->num_blocks, sizeof *block_list, intcmp);
+    qsort(block_list, ftn->num_blocks, sizeof *block_list, intcmp);
 
-    // XOR blocks together
-    output->string = calloc(blk_size, sizeof *output->string);
-    if (!output->string) goto free_ftn;
+    // A whole block on its own can be sent from where it lies
+    size_t first = offset + (size_t)block_list[0] * blk_size;
+    if (ftn->num_blocks == 1 && first + blk_size <= length) {
+        ftn->string = (char*)string + first;
+        return;
+    }
 
-    for (int i = 0; i < output->num_blocks; i++) {
-        int m = block_list[i] * blk_size;
-        if (offset + m < length)
-            xorncpy(output->string,
-                    string + offset + m,
-                    min(blk_size, length - offset - m));
+    // XOR blocks together
+    memset(scratch, 0, blk_size);
+    for (int i = 0; i < ftn->num_blocks; i++) {
+        size_t m = offset + (size_t)block_list[i] * blk_size;
+        if (m < length)
+            xorncpy(scratch, string + m, min(blk_size, length - m));
     }
+    ftn->string = scratch;
+}
+
+fountain_s* make_fountain(const char* string, int blk_size, size_t length, int section, int section_size) {
+    fountain_s* output = malloc(sizeof *output);
+    if (output == NULL) return NULL;
+
+    char* buffer = malloc(blk_size);
+    if (!buffer) goto free_output;
+
+    encode_fountain(output, buffer, string, blk_size, length,
+                    section, section_size, rand(), rand());
+    if (output->string != buffer)
+        memcpy(buffer, output->string, blk_size);
+    output->string = buffer;
 
     // We need to allocate the blockset for our local test version
-    output->block_set =
-        seeded_select_blockset(n, output->num_blocks, output->seed);
+    output->block_set = seeded_select_blockset(section_size,
+                                               output->num_blocks, output->seed);
     if (!output->block_set) goto free_ftn;
-    output->block_set_len = bset_len(n);
+    output->block_set_len = bset_len(section_size);
 
     return output;
 
 free_ftn:
     free_fountain(output);
     return NULL;
+free_output:
+    free(output);
+    return NULL;
 }
 
 void free_fountain(fountain_s* ftn) {
@@ -309,7 +370,7 @@ static int blockset_lowest_set_above(bset block_set, int block_set_len, int star
     bset_int k = j >> BSET_BITS_W; // Index of integer to check
     bset_int x = 1ULL << (j & (BSET_BITS-1));
     bset_int mask = x | ~(x - 1);
-    while (!(block_set[k] & mask) && k < block_set_len) {
+    while (k < block_set_len && !(block_set[k] & mask)) {
         k += 1;
         j = k << BSET_BITS_W;
         mask = ~0;
@@ -452,6 +513,51 @@ static int reduce_against_hold(packethold_s* hold, fountain_s* ftn) {
 }
 
 
+/*
+ * Like reduce_fountain but for any pair of packets, not just subsets
+ */
+static void xor_fountain(const fountain_s* src, fountain_s* dst) {
+    xorncpy(dst->string, src->string, src->blk_size);
+
+    int num_blocks = 0;
+    const int n = dst->block_set_len;
+    for (int i = 0; i < n; i++) {
+        dst->block_set[i] ^= src->block_set[i];
+        num_blocks += popcount(dst->block_set[i]);
+    }
+    dst->num_blocks = num_blocks;
+}
+
+/*
+ * Reduce the block set against the echelon basis and keep whatever is left
+ * as a new basis row. Every packet received goes through here before it is
+ * decoded so rank counts the independent packets we have had.
+ * returns 1 if the packet was independent of those, 0 if it tells us nothing
+ *         new
+ */
+static int decodestate_add_to_basis(decodestate_s* state, const bset block_set) {
+    if (state->rank == state->num_blocks)
+        return 0;
+
+    const int len = bset_len(state->num_blocks);
+    bset_int row[len];
+    memcpy(row, block_set, len * sizeof *row);
+
+    int j = 0;
+    while ((j = blockset_lowest_set_above(row, len, j)) >= 0) {
+        bset pivot = state->basis + j * len;
+        if (!IsBitSet(pivot, j)) {
+            memcpy(pivot, row, len * sizeof *row);
+            state->rank++;
+            return 1;
+        }
+        // bits below j are clear in both
+        for (int i = j >> BSET_BITS_W; i < len; i++)
+            row[i] ^= pivot[i];
+    }
+    return 0;
+}
+
 typedef int (*blockread_f)(void* /*buffer*/,
                             int /*blk_num*/,
                             decodestate_s* /*state*/);
@@ -464,6 +570,76 @@ static int write_hold_ftn_to_output(
         decodestate_s* state,
         packethold_s* hold, int hold_offset, blockwrite_f bwrite);
 
+/*
+ * Once the packets received span the whole section we can solve the hold with
+ * gaussian elimination, even where reducing by subsets has got stuck
+ */
+static int solve_hold(decodestate_s* state, blockread_f bread,
+        blockwrite_f bwrite) {
+    packethold_s* hold = state->hold;
+    bset blkdec = state->blkdecoded;
+    const int blk_size = state->blk_size;
+    char buf[blk_size];
+
+    debug("Solving hold of %d packets", hold->num_packets);
+
+    // Take the blocks we have already decoded out of everything held
+    for (int i = 0; i < hold->num_packets; i++) {
+        if (ISBITSET(hold->deleted, i))
+            continue;
+        fountain_s* ftn = hold->fountain + i;
+        for (int j = 0; (j = blockset_lowest_set_above(
+                        ftn->block_set, ftn->block_set_len, j)) >= 0; j++) {
+            if (IsBitSet(blkdec, j)) {
+                bread(buf, j, state);
+                xorncpy(ftn->string, buf, blk_size);
+                ClearBit(ftn->block_set, j);
+                ftn->num_blocks--;
+            }
+        }
+    }
+
+    // Gauss-Jordan: give each undecoded block a pivot packet and clear that
+    // block from every other packet
+    char* pivoted = calloc((hold->num_packets + 7) / 8, sizeof *pivoted);
+    if (!pivoted) return ERR_MEM;
+    for (int col = 0; col < state->num_blocks; col++) {
+        if (IsBitSet(blkdec, col))
+            continue;
+        int p;
+        for (p = 0; p < hold->num_packets; p++) {
+            if (!ISBITSET(hold->deleted, p) && !ISBITSET(pivoted, p)
+                    && IsBitSet(hold->fountain[p].block_set, col))
+                break;
+        }
+        if (p == hold->num_packets)
+            continue;
+        SETBIT(pivoted, p);
+        for (int r = 0; r < hold->num_packets; r++) {
+            if (r != p && !ISBITSET(hold->deleted, r)
+                    && IsBitSet(hold->fountain[r].block_set, col))
+                xor_fountain(hold->fountain + p, hold->fountain + r);
+        }
+    }
+    free(pivoted);
+
+    // Each pivot packet is now a single block and the rest are empty
+    for (int i = 0; i < hold->num_packets; i++) {
+        if (ISBITSET(hold->deleted, i))
+            continue;
+        if (hold->fountain[i].num_blocks == 1) {
+            int result = write_hold_ftn_to_output(state, hold, i, bwrite);
+            if (result < 0)
+                return result;
+        } else if (hold->fountain[i].num_blocks == 0) {
+            fountain_s empty;
+            packethold_remove(hold, i, &empty);
+        }
+    }
+    packethold_collect_garbage(hold);
+    return 0;
+}
+
 
 static int _decode_fountain(decodestate_s* state, fountain_s* ftn,
         blockread_f bread, blockwrite_f bwrite) {
@@ -478,6 +654,11 @@ static int _decode_fountain(decodestate_s* state, fountain_s* ftn,
     //packethold_print(hold);
     //#endif
 
+    // A packet that is a combination of ones we already have, a repeat of
+    // one included, can only ever reduce to nothing
+    if (!decodestate_add_to_basis(state, ftn->block_set))
+        return F_ALREADY_DECODED;
+
     do {
         retest = false;
         // Case one, block size one
@@ -563,19 +744,12 @@ static int _decode_fountain(decodestate_s* state, fountain_s* ftn,
             }
         }
     } while (retest);
-    if (ftn->num_blocks != 1) {
-        bool inhold = false;
-        for (size_t i = 0; i < hold->offset; i++) {
-            if (cmp_fountain(ftn, hold->fountain + i) == 0) {
-                inhold = true;
-                break;
-            }
-        }
-        if (!inhold) { /* Add packet to hold */
-            if (packethold_add(hold, ftn) < 0)
-                return handle_error(ERR_PACKET_ADD, NULL);
-        }
+    if (ftn->num_blocks != 1) { /* Add packet to hold */
+        if (packethold_add(hold, ftn) < 0)
+            return handle_error(ERR_PACKET_ADD, NULL);
     }
+    if (state->rank == state->num_blocks && !decodestate_is_decoded(state))
+        return solve_hold(state, bread, bwrite);
     return 0;
 }
 
@@ -600,13 +774,10 @@ int write_hold_ftn_to_output(
                                             write to file */
         if (bwrite(tmp_ftn->string, tmp_bn, state) != 1) {
             __builtin_trap(); // catch those funny errors
-            free(tmp_ftn->string);
             return ERR_BWRITE;
         }
         SetBit(blkdec, tmp_bn);
     }
-
-    free(tmp_ftn->string);
     return 0;
 }
 
@@ -691,6 +862,51 @@ cleanup:
     return NULL;
 }
 
+/*
+ * Fletcher16 over data that comes in pieces, e.g. a header and a payload that
+ * are sent from different places. The sums are reduced after every 20 bytes
+ * counting from the very start, so the result is the same however the data
+ * is split up.
+ */
+typedef struct fletcher16_s {
+    uint16_t sum1, sum2;
+    int run;    // bytes since the last reduction
+} fletcher16_s;
+
+#define FLETCHER16_INIT { .sum1 = 0xff, .sum2 = 0xff, .run = 0 }
+
+static void fletcher16_update(fletcher16_s* f, uint8_t const * data, size_t bytes)
+{
+    while (bytes) {
+        size_t tlen = 20 - f->run;
+        if (tlen > bytes)
+            tlen = bytes;
+        bytes -= tlen;
+        f->run += tlen;
+        do {
+            f->sum2 += f->sum1 += *data++;
+        } while (--tlen);
+        if (f->run == 20) {
+            f->sum1 = (f->sum1 & 0xff) + (f->sum1 >> 8);
+            f->sum2 = (f->sum2 & 0xff) + (f->sum2 >> 8);
+            f->run = 0;
+        }
+    }
+}
+
+static uint16_t fletcher16_final(fletcher16_s* f)
+{
+    if (f->run) {
+        f->sum1 = (f->sum1 & 0xff) + (f->sum1 >> 8);
+        f->sum2 = (f->sum2 & 0xff) + (f->sum2 >> 8);
+    }
+    /* Second reduction step to reduce sums to 8
+     * bits */
+    f->sum1 = (f->sum1 & 0xff) + (f->sum1 >> 8);
+    f->sum2 = (f->sum2 & 0xff) + (f->sum2 >> 8);
+    return f->sum2 << 8 | f->sum1;
+}
+
 /* Copied not quite verbatim from wikipedia.
    Used to check that network packets are intact
  */
@@ -705,117 +921,327 @@ static uint16_t Fletcher16(uint8_t const * data, size_t bytes)
     }
     return (sum2 << 8) | sum1;
 #else // The more efficient of the 2 implementations on wikipaedia
-    uint16_t sum1 = 0xff, sum2 = 0xff;
-    size_t tlen;
+    fletcher16_s f = FLETCHER16_INIT;
+    fletcher16_update(&f, data, bytes);
+    return fletcher16_final(&f);
+#endif
+}
 
-    while (bytes) {
-        tlen = bytes >= 20 ? 20 : bytes;
-        bytes -= tlen;
-        do {
-            sum2 += sum1 += *data++;
-        } while (--tlen);
-        sum1 = (sum1 & 0xff) + (sum1 >> 8);
-        sum2 = (sum2 & 0xff) + (sum2 >> 8);
+/*
+ * The checksum over the header and the payload, worked out over each
+ * separately as they need not be next to each other
+ */
+static uint32_t fountain_checksum(int checksum, const char* header,
+                                  int header_size, const char* payload,
+                                  int blk_size) {
+    if (checksum == FTN_CHECKSUM_CRC32C) {
+        uint32_t crc = crc32c(0, header, header_size);
+        return crc32c(crc, payload, blk_size);
     }
-    /* Second reduction step to reduce sums to 8
-     * bits */
-    sum1 = (sum1 & 0xff) + (sum1 >> 8);
-    sum2 = (sum2 & 0xff) + (sum2 >> 8);
-    return sum2 << 8 | sum1;
-#endif
+    fletcher16_s f = FLETCHER16_INIT;
+    fletcher16_update(&f, (uint8_t*)header, header_size);
+    fletcher16_update(&f, (uint8_t*)payload, blk_size);
+    return fletcher16_final(&f);
 }
 
-static int fountain_packet_size(fountain_s* ftn) {
-    return sizeof(uint16_t) // Make space for the checksum
-        + FTN_HEADER_SIZE
-        + ftn->blk_size;
-    // don't transfer the block list
+/* v1 keeps the checksum in the sender's byte order, v2 big-endian */
+static void write_checksum(ftn_wire_s wire, char* header, uint32_t value) {
+    if (wire.version == FTN_WIRE_V2) {
+        for (int i = FTN_CHECKSUM_SIZE(wire.checksum) - 1; i >= 0; i--) {
+            header[i] = value & 0xff;
+            value >>= 8;
+        }
+    } else if (wire.checksum == FTN_CHECKSUM_CRC32C) {
+        memcpy(header, &value, sizeof value);
+    } else {
+        uint16_t value16 = value;
+        memcpy(header, &value16, sizeof value16);
+    }
 }
 
-/* Serializes the sub-structures so that we can send it across the network
- */
-buffer_s pack_fountain(fountain_s* ftn) {
+static uint32_t read_checksum(ftn_wire_s wire, const char* header) {
+    if (wire.version == FTN_WIRE_V2) {
+        uint32_t value = 0;
+        for (int i = 0; i < FTN_CHECKSUM_SIZE(wire.checksum); i++)
+            value = value << 8 | (uint8_t)header[i];
+        return value;
+    }
+    if (wire.checksum == FTN_CHECKSUM_CRC32C) {
+        uint32_t value;
+        memcpy(&value, header, sizeof value);
+        return value;
+    }
+    uint16_t value16;
+    memcpy(&value16, header, sizeof value16);
+    return value16;
+}
 
-    int packet_size = fountain_packet_size(ftn);
-    void* buf_start = malloc(packet_size);
-    if (!buf_start) return (buffer_s){.length=0, .buffer=NULL};
+/* The fields of a v2 header, see fountain.h */
+typedef struct ftn_v2_header_s {
+    int codec;
+    int section;
+    uint32_t symbol_id;
+    int checksum_at;    // bytes before the checksum
+    int size;           // bytes up to the payload
+} ftn_v2_header_s;
+
+static int put_varint(uint8_t* p, unsigned value) {
+    int n = 0;
+    while (value >= 0x80) {
+        p[n++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    p[n++] = value;
+    return n;
+}
+
+/* returns the number of bytes read or -1 if there is no valid 16 bit varint */
+static int get_varint(const uint8_t* p, int length, unsigned* value) {
+    *value = 0;
+    for (int n = 0; n < 3 && n < length; n++) {
+        *value |= (unsigned)(p[n] & 0x7f) << (7 * n);
+        if (!(p[n] & 0x80))
+            return (*value <= UINT16_MAX) ? n + 1 : -1;
+    }
+    return -1;
+}
 
-    uint16_t checksum = 0;
+static int pack_v2_header(fountain_s* ftn, ftn_wire_s wire, char* header) {
+    uint8_t* p = (uint8_t*)header;
+    *p++ = FTN_WIRE_V2;
+    *p++ = FTN_CODEC_LT;
+    p += put_varint(p, ftn->section);
+    for (int i = 24; i >= 0; i -= 8)
+        *p++ = ftn->symbol_id >> i;
+
+    int checksum_at = p - (uint8_t*)header;
+    write_checksum(wire, header + checksum_at,
+                   fountain_checksum(wire.checksum, header, checksum_at,
+                                     ftn->string, ftn->blk_size));
+    return checksum_at + FTN_CHECKSUM_SIZE(wire.checksum);
+}
 
-    // reference the memory after the checksum for convenience
-    void* packed_ftn = buf_start + sizeof checksum;
+/* returns 0 or -1 if the packet is too short or not v2 */
+static int parse_v2_header(buffer_s packet, int checksum, ftn_v2_header_s* h) {
+    const uint8_t* p = (const uint8_t*)packet.buffer;
+    if (!p || packet.length < 2 || p[0] != FTN_WIRE_V2)
+        return -1;
+    h->codec = p[1];
+
+    unsigned section;
+    int n = get_varint(p + 2, packet.length - 2, &section);
+    if (n < 0)
+        return -1;
+    h->section = section;
+
+    h->checksum_at = 2 + n + sizeof(uint32_t);
+    h->size = h->checksum_at + FTN_CHECKSUM_SIZE(checksum);
+    if (packet.length < h->size)
+        return -1;
+    p += 2 + n;
+    h->symbol_id = (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+    return 0;
+}
 
+int pack_fountain_header(fountain_s* ftn, ftn_wire_s wire, char* header) {
+    if (wire.version == FTN_WIRE_V2)
+        return pack_v2_header(ftn, wire, header);
+
+    // reference the memory after the checksum for convenience
+    char* packed_ftn = header + FTN_CHECKSUM_SIZE(wire.checksum);
     memcpy(packed_ftn, ftn, FTN_HEADER_SIZE);
-    memcpy(packed_ftn + FTN_HEADER_SIZE, ftn->string, ftn->blk_size);
 
-    // TODO: do byte order conversions
+    write_checksum(wire, header, fountain_checksum(wire.checksum, packed_ftn,
+                                                   FTN_HEADER_SIZE,
+                                                   ftn->string,
+                                                   ftn->blk_size));
+    return PACKED_FTN_HEADER_SIZE(wire);
+}
+
+/* Serializes the sub-structures so that we can send it across the network
+ */
+buffer_s pack_fountain(fountain_s* ftn, ftn_wire_s wire) {
+
+    // don't transfer the block list
+    char* buf_start = malloc(PACKED_FTN_SIZE(wire, ftn->blk_size));
+    if (!buf_start) return (buffer_s){.length=0, .buffer=NULL};
 
-    // now we can calculate and fill in the hole at the beginning
-    checksum = Fletcher16(packed_ftn, packet_size - sizeof checksum);
-    memcpy(buf_start, &checksum, sizeof checksum);
+    int header_size = pack_fountain_header(ftn, wire, buf_start);
+    memcpy(buf_start + header_size, ftn->string, ftn->blk_size);
 
     return (buffer_s) {
-        .length = packet_size,
+        .length = header_size + ftn->blk_size,
         .buffer = buf_start
     };
 }
 
 
-fountain_s* unpack_fountain(buffer_s packet, int section_size_in_blocks) {
-    if (!packet.buffer) return NULL;
+int check_fountain(buffer_s packet, ftn_wire_s wire) {
+    uint32_t expected, calculated;
+    if (wire.version == FTN_WIRE_V2) {
+        ftn_v2_header_s h;
+        if (parse_v2_header(packet, wire.checksum, &h) < 0)
+            return 0;
+        expected = read_checksum(wire, packet.buffer + h.checksum_at);
+        calculated = fountain_checksum(wire.checksum, packet.buffer,
+                                       h.checksum_at, packet.buffer + h.size,
+                                       packet.length - h.size);
+    } else {
+        const int header_size = PACKED_FTN_HEADER_SIZE(wire);
+        if (!packet.buffer || packet.length < header_size)
+            return 0;
 
-    uint16_t checksum = *((uint16_t*)packet.buffer);
-// place the pointer passed the checksum to make the rest of the code in this
-// function a tad more readble
-    char const * packed_ftn = packet.buffer + sizeof checksum;
+        expected = read_checksum(wire, packet.buffer);
+        char const * packed_ftn = packet.buffer
+                                  + FTN_CHECKSUM_SIZE(wire.checksum);
 
 // because our fountain packet can be of variable size we had to wait until
 // this point before we were able to calculate the checksum
-    uint16_t calculated = Fletcher16((uint8_t*)packed_ftn, packet.length - sizeof checksum);
-    odebug("%"PRIu16, checksum);
-    odebug("%"PRIu16, calculated);
-    if (checksum != calculated) {
+        int length = packet.length - FTN_CHECKSUM_SIZE(wire.checksum);
+        calculated = wire.checksum == FTN_CHECKSUM_CRC32C
+            ? crc32c(0, packed_ftn, length)
+            : Fletcher16((uint8_t*)packed_ftn, length);
+    }
+    odebug("%"PRIu32, expected);
+    odebug("%"PRIu32, calculated);
+    if (expected != calculated) {
         log_warn("checksums do not match");
-        return NULL; }
+        return 0;
+    }
+    return 1;
+}
+
+int packed_fountain_section(buffer_s packet, ftn_wire_s wire) {
+    if (wire.version == FTN_WIRE_V2) {
+        ftn_v2_header_s h;
+        return (parse_v2_header(packet, wire.checksum, &h) < 0)
+               ? -1 : h.section;
+    }
+    uint16_t section;
+    if (!packet.buffer || packet.length < PACKED_FTN_HEADER_SIZE(wire))
+        return -1;
+    memcpy(&section, packet.buffer + FTN_CHECKSUM_SIZE(wire.checksum)
+                        + offsetof(fountain_s, section), sizeof section);
+    return section;
+}
+
+int packed_fountain_symbol_id(buffer_s packet, ftn_wire_s wire,
+                              uint32_t* symbol_id) {
+    ftn_v2_header_s h;
+    if (wire.version != FTN_WIRE_V2
+            || parse_v2_header(packet, wire.checksum, &h) < 0)
+        return -1;
+    *symbol_id = h.symbol_id;
+    return 0;
+}
+
+fountain_s* unpack_fountain(buffer_s packet, ftn_wire_s wire,
+                            int section_size_in_blocks) {
+    if (!check_fountain(packet, wire))
+        return NULL;
+    return unpack_checked_fountain(packet, wire, section_size_in_blocks);
+}
 
+/* Fill in the header fields of ftn from a v2 packet
+   returns 0 or -1 if it is not one we can decode */
+static int view_v2_header(buffer_s packet, ftn_wire_s wire,
+                          int section_size_in_blocks, fountain_s* ftn) {
+    ftn_v2_header_s h;
+    if (parse_v2_header(packet, wire.checksum, &h) < 0
+            || h.codec != FTN_CODEC_LT
+            || packet.length - h.size > MAX_BLOCK_SIZE)
+        return -1;
+    ftn->blk_size = packet.length - h.size;
+    ftn->section = h.section;
+    ftn->symbol_id = h.symbol_id;
+    ftn->seed = symbol_seed(wire.nonce, h.section, h.symbol_id);
+    ftn->num_blocks = seeded_num_blocks(section_size_in_blocks, ftn->seed);
+    ftn->string = packet.buffer + h.size;
+    return 0;
+}
+
+int view_fountain(buffer_s packet, ftn_wire_s wire, int section_size_in_blocks,
+                  fountain_s* ftn, void* block_set) {
+    if (wire.version == FTN_WIRE_V2) {
+        if (view_v2_header(packet, wire, section_size_in_blocks, ftn) < 0) {
+            log_warn("Invalid fountain header");
+            return -1;
+        }
+    } else {
+// place the pointer passed the checksum to make the rest of the code in this
+// function a tad more readble
+        char * packed_ftn = packet.buffer + FTN_CHECKSUM_SIZE(wire.checksum);
+        memcpy(ftn, packed_ftn, FTN_HEADER_SIZE);
+        ftn->string = packed_ftn + FTN_HEADER_SIZE;
+    }
+
+    // Intact but not something we can decode
+    if (ftn->blk_size <= 0
+            || (ftn->string - packet.buffer) + ftn->blk_size > packet.length
+            || ftn->num_blocks <= 0
+            || ftn->num_blocks > section_size_in_blocks) {
+        log_warn("Invalid fountain header");
+        return -1;
+    }
+
+    seeded_fill_blockset(block_set, section_size_in_blocks,
+                         ftn->num_blocks, ftn->seed);
+    ftn->block_set = block_set;
+    ftn->block_set_len = bset_len(section_size_in_blocks);
+    return 0;
+}
+
+fountain_s* unpack_checked_fountain(buffer_s packet, ftn_wire_s wire,
+                                    int section_size_in_blocks) {
     fountain_s* ftn = malloc(sizeof *ftn);
     if (!ftn)  return NULL;
-    memcpy(ftn, packed_ftn, FTN_HEADER_SIZE);
 
-    // TODO: do byte order conversions
+    bset block_set = bset_alloc(section_size_in_blocks);
+    if (!block_set) goto free_fountain;
+    if (view_fountain(packet, wire, section_size_in_blocks,
+                      ftn, block_set) < 0)
+        goto free_block_set;
 
+    char* view_string = ftn->string;
     ftn->string = malloc(ftn->blk_size);
-    if (!ftn->string) goto free_fountain;
-    memcpy(ftn->string, packed_ftn + FTN_HEADER_SIZE, ftn->blk_size);
-
-    ftn->block_set = seeded_select_blockset(section_size_in_blocks,
-                                            ftn->num_blocks, ftn->seed);
-    if (!ftn->block_set) goto free_string;
-    ftn->block_set_len = bset_len(section_size_in_blocks);
+    if (!ftn->string) goto free_block_set;
+    memcpy(ftn->string, view_string, ftn->blk_size);
 
     return ftn;
-free_string:
-    if (ftn->string) free(ftn->string);
+free_block_set:
+    bset_free(block_set);
 free_fountain:
     free(ftn);
     // should we have a more resilient handler / a kinder one...
     return NULL;
 }
 
+void* blockset_scratch_new(int section_size_in_blocks) {
+    return bset_alloc(section_size_in_blocks);
+}
+
+void blockset_scratch_free(void* block_set) {
+    bset_free(block_set);
+}
+
 /* ============ Packhold Functions ========================================= */
 
-packethold_s* packethold_new(int num_blocks) {
+packethold_s* packethold_new(int num_blocks, int blk_size) {
     packethold_s* hold = malloc(sizeof *hold);
     if (!hold) return NULL;
     memset(hold, 0, sizeof *hold);
 
     hold->num_slots = BUFFER_SIZE;
+    hold->blk_size = blk_size;
 
     hold->fountain = calloc(BUFFER_SIZE, sizeof *hold->fountain);
     if (!hold->fountain) goto free_hold;
 
+    hold->strings = malloc(BUFFER_SIZE * blk_size);
+    if (!hold->strings) goto free_fountain;
+
     hold->mark = calloc((BUFFER_SIZE + 7) / 8, sizeof *hold->mark);
-    if (!hold->mark) goto free_fountain;
+    if (!hold->mark) goto free_strings;
 
     hold->deleted = calloc((BUFFER_SIZE + 7) / 8, sizeof *hold->deleted);
     if (!hold->deleted) goto free_mark;
@@ -828,19 +1254,17 @@ free_deleted:
     free(hold->deleted);
 free_mark:
     free(hold->mark);
+free_strings:
+    free(hold->strings);
 free_fountain:
     free(hold->fountain);
 free_hold:
-    packethold_free(hold);
+    free(hold);
     return NULL;
 }
 
 void packethold_free(packethold_s* hold) {
-    for (int i = 0; i < hold->num_packets; i++) {
-        if (!ISBITSET(hold->deleted, i)) {
-            free(hold->fountain[i].string);
-        }
-    }
+    if (hold->strings) free(hold->strings);
     if (hold->mark) free(hold->mark);
     if (hold->deleted) free(hold->deleted);
     if (hold->fountain) free(hold->fountain);
@@ -865,8 +1289,6 @@ fountain_s* packethold_remove(packethold_s* hold, int pos, fountain_s* output) {
     assert(pos >= 0 && pos < hold->num_packets);
 
     *output = hold->fountain[pos];
-    hold->fountain[pos].string = NULL;
-    hold->fountain[pos].block_set = NULL;
 
     debug("Setting pos %d as deleted", pos);
     SETBIT(hold->deleted, pos);
@@ -900,6 +1322,8 @@ void packethold_collect_garbage(packethold_s* hold)
     for (; i < hold->num_packets; i++) {
         if (!ISBITSET(deleted, i)) {
             ftns[mp] = ftns[i];
+            ftns[mp].string = hold->strings + mp * hold->blk_size;
+            memcpy(ftns[mp].string, ftns[i].string, hold->blk_size);
             bset old_bset = ftns[mp].block_set;
             ftns[mp].block_set = hold->block_sets + (mp * ftns[mp].block_set_len);
             memcpy(ftns[mp].block_set, old_bset,
@@ -930,6 +1354,16 @@ int packethold_add(packethold_s* hold, fountain_s* ftn) {
             return REALLOC_ERR;
         }
 
+        char* strings_tmp = realloc(hold->strings, space * hold->blk_size);
+        if (!strings_tmp) {
+            return handle_error(REALLOC_ERR, NULL);
+        } else {
+            hold->strings = strings_tmp;
+            for (int i = 0, n = hold->offset; i < n; i++) {
+                hold->fountain[i].string = hold->strings + i * hold->blk_size;
+            }
+        }
+
         char* mark_tmp_ptr = realloc(hold->mark, (space + 7) / 8);
         if (!mark_tmp_ptr) {
             return handle_error(REALLOC_ERR, NULL);
@@ -978,15 +1412,15 @@ int packethold_add(packethold_s* hold, fountain_s* ftn) {
            ftn->block_set,
            ftn->block_set_len * sizeof *ftn->block_set);
 
-    // Shallow copy and null out the pointers since this is always the last
-    // thing to happen before returning the packet
+    // Likewise the payload, the caller's copy may well be a network buffer
+    // that is about to be reused
+    char* dst_string = hold->strings + (hold->offset * hold->blk_size);
+    memcpy(dst_string, ftn->string, hold->blk_size);
+
+    // Make the stored fountain point into our own arrays
     fountain_s* dst = &hold->fountain[hold->offset++];
     *dst = *ftn;
-    ftn->string = NULL;
-    // Don't need to null this out or dealloc as the caller of _decode... will
-    // do this
-    //bset_free(ftn->block_set);
-    // Make the stored fountain point into our block_set array
+    dst->string = dst_string;
     dst->block_set = dst_bset;
 
     CLEARBIT(hold->mark, hold->num_packets);
@@ -1023,6 +1457,8 @@ void packethold_print(packethold_s* hold) {
    int packets_so_far
    char* filename
    FILE* fp
+   int* basis
+   int rank
  */
 
 decodestate_s* decodestate_new(int blk_size, int num_blocks) {
@@ -1035,16 +1471,18 @@ decodestate_s* decodestate_new(int blk_size, int num_blocks) {
         .blk_size = blk_size
     };
 
-    output->hold = packethold_new(num_blocks);
+    output->hold = packethold_new(num_blocks, blk_size);
     if (!output->hold) goto cleanup;
 
+    // decodestate_free cleans up whatever has been allocated so far
     output->blkdecoded = bset_alloc(num_blocks);
-    if (!output->blkdecoded) goto free_hold;
+    if (!output->blkdecoded) goto cleanup;
+
+    output->basis = bset_alloc_many(num_blocks, num_blocks);
+    if (!output->basis) goto cleanup;
 
     return output;
 
-free_hold:
-    packethold_free(output->hold);
 cleanup:
     decodestate_free(output);
     return NULL;
@@ -1053,6 +1491,8 @@ cleanup:
 void decodestate_free(decodestate_s* state) {
     if (state->blkdecoded)
         bset_free(state->blkdecoded);
+    if (state->basis)
+        bset_free(state->basis);
     if (state->hold)
         packethold_free(state->hold);
     free(state);
@@ -1072,7 +1512,21 @@ int decodestate_is_decoded(decodestate_s* state) {
     return (num_solved == state->num_blocks);
 }
 
+int decodestate_symbols_needed(decodestate_s* state) {
+    return state->num_blocks - state->rank;
+}
+
 #ifdef UNIT_TESTS
+/* whether digest is the one written out in hex */
+static bool digest_is(const uint8_t digest[SHA256_SIZE], const char* hex) {
+    for (int i = 0; i < SHA256_SIZE; i++) {
+        unsigned int byte;
+        if (sscanf(hex + 2 * i, "%2x", &byte) != 1 || digest[i] != byte)
+            return false;
+    }
+    return true;
+}
+
 int main(int argc, char** argv) {
 
     int i = 0;
@@ -1138,6 +1592,458 @@ int main(int argc, char** argv) {
             printf("FAILED: i = %d, j = %d, expected = %d, actual = %d\n",
                     i, j, expected, actual);
     }
+    {
+        bool passed = true;
+        const int blk_size = 16, num_blocks = 200;
+        printf("Testing decodestate_symbols_needed...\n");
+        char input[blk_size * num_blocks];
+        for (i = 0; i < sizeof input; i++)
+            input[i] = rand();
+        char output[sizeof input];
+
+        memdecodestate_s* state = (memdecodestate_s*)
+            realloc(decodestate_new(blk_size, num_blocks), sizeof *state);
+        state->filename = memdecodestate_filename;
+        state->result = output;
+
+        int needed = decodestate_symbols_needed(&state->state);
+        passed = (needed == num_blocks);
+        while (passed && !decodestate_is_decoded(&state->state)) {
+            fountain_s* ftn = make_fountain(input, blk_size, sizeof input,
+                                            0, num_blocks);
+            state->packets_so_far++;
+            passed = memdecode_fountain(state, ftn) >= 0;
+            free_fountain(ftn);
+
+            int now_needed = decodestate_symbols_needed(&state->state);
+            passed = passed && now_needed <= needed && now_needed >= 0
+                && (now_needed == 0) == decodestate_is_decoded(&state->state);
+            needed = now_needed;
+        }
+        passed = passed && memcmp(input, output, sizeof input) == 0;
+        if (passed)
+            printf("PASSED: %d packets for %d blocks\n",
+                    state->packets_so_far, num_blocks);
+        else
+            printf("FAILED: packets = %d, needed = %d\n",
+                    state->packets_so_far, needed);
+        decodestate_free(&state->state);
+    }
+
+    {
+        // An odd block size so that the header and payload split the
+        // checksum's 20 byte runs awkwardly
+        const int blk_size = 37, num_blocks = 8;
+        bool passed = true;
+        printf("Testing pack_fountain_header...\n");
+        char input[blk_size * num_blocks - 5];
+        for (i = 0; i < sizeof input; i++)
+            input[i] = rand();
+        char scratch[blk_size];
+
+        ftn_wire_s wires[] = {
+            { FTN_WIRE_V1, FTN_CHECKSUM_FLETCHER16, rand() },
+            { FTN_WIRE_V1, FTN_CHECKSUM_CRC32C, rand() },
+            { FTN_WIRE_V2, FTN_CHECKSUM_FLETCHER16, rand() },
+            { FTN_WIRE_V2, FTN_CHECKSUM_CRC32C, rand() },
+        };
+        bset block_set = bset_alloc(num_blocks);
+        for (i = 0; passed && i < 400; i++) {
+            ftn_wire_s wire = wires[i % 4];
+            // large sections take more than one byte of varint
+            int section = (i & 4) ? i * 331 % 65536 : 0;
+            fountain_s ftn;
+            encode_fountain(&ftn, scratch, input, blk_size, sizeof input,
+                            section, num_blocks, wire.nonce, i);
+            char packet[PACKED_FTN_SIZE(wire, blk_size)];
+            int header_size = pack_fountain_header(&ftn, wire, packet);
+            memcpy(packet + header_size, ftn.string, blk_size);
+            buffer_s buf = { .length = header_size + blk_size,
+                             .buffer = packet };
+            uint32_t symbol_id;
+            passed = check_fountain(buf, wire)
+                && packed_fountain_section(buf, wire) == section
+                && (wire.version == FTN_WIRE_V2
+                    ? packed_fountain_symbol_id(buf, wire, &symbol_id) == 0
+                      && symbol_id == i
+                    : packed_fountain_symbol_id(buf, wire, &symbol_id) < 0);
+
+            // everything the decoder needs comes back out of the header
+            fountain_s view;
+            passed = passed
+                && view_fountain(buf, wire, num_blocks, &view, block_set) == 0
+                && view.section == section && view.seed == ftn.seed
+                && view.num_blocks == ftn.num_blocks
+                && view.blk_size == blk_size
+                && memcmp(view.string, ftn.string, blk_size) == 0;
+
+            // and a flipped bit anywhere gets caught
+            int bit = rand() % (8 * buf.length);
+            packet[bit / 8] ^= 1 << (bit % 8);
+            passed = passed && !check_fountain(buf, wire);
+        }
+        bset_free(block_set);
+        if (passed)
+            printf("PASSED\n");
+        else
+            printf("FAILED: i = %d\n", i - 1);
+    }
+    {
+        typedef uint32_t (*crc_fn)(uint32_t, const void*, size_t);
+        crc_fn fns[] = { crc32c, crc32c_sw };
+        bool passed = true;
+        int f = 0;
+        printf("Testing crc32c...\n");
+        char input[1000];
+        for (i = 0; i < sizeof input; i++)
+            input[i] = rand();
+
+        for (f = 0; passed && f < 2; f++) {
+            // the check value from RFC 3720
+            passed = fns[f](0, "123456789", 9) == 0xe3069283;
+
+            // pieces at every alignment come to the same as the whole
+            for (i = 0; passed && i < 64; i++) {
+                const int len = sizeof input - i;
+                uint32_t whole = fns[f](0, input + i, len);
+                uint32_t crc = 0;
+                int done = 0;
+                while (done < len) {
+                    int piece = rand() % 20;
+                    if (piece > len - done) piece = len - done;
+                    crc = fns[f](crc, input + i + done, piece);
+                    done += piece;
+                }
+                passed = crc == whole && whole == crc32c_sw(0, input + i, len);
+            }
+        }
+        if (passed)
+            printf("PASSED\n");
+        else
+            printf("FAILED: %s, i = %d\n", f == 1 ? "crc32c" : "crc32c_sw",
+                   i - 1);
+    }
+    {
+        // The examples from FIPS 180-2
+        const char* messages[] = {
+            "", "abc",
+            "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq"
+        };
+        const char* digests[] = {
+            "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855",
+            "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad",
+            "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1",
+            "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0"
+        };
+        bool passed = true;
+        uint8_t digest[SHA256_SIZE];
+        sha256_s ctx;
+        printf("Testing sha256...\n");
+        for (i = 0; passed && i < 3; i++) {
+            sha256_init(&ctx);
+            sha256_update(&ctx, messages[i], strlen(messages[i]));
+            sha256_final(&ctx, digest);
+            passed = digest_is(digest, digests[i]);
+        }
+        // a million 'a's in odd pieces, so that most straddle a block
+        if (passed) {
+            char a[127];
+            memset(a, 'a', sizeof a);
+            sha256_init(&ctx);
+            for (int done = 0, piece = 1; done < 1000000;
+                    done += piece, piece = (piece + 2) % 128) {
+                if (piece > 1000000 - done)
+                    piece = 1000000 - done;
+                sha256_update(&ctx, a, piece);
+            }
+            sha256_final(&ctx, digest);
+            passed = digest_is(digest, digests[3]);
+        }
+        if (passed)
+            printf("PASSED\n");
+        else
+            printf("FAILED: message %d\n", i - 1);
+    }
+    {
+        // Leaves of "a", "b" and "c", worked out apart from sha256.c
+        const char* roots[] = {
+            "022a6979e6dab7aa5ae4c3e5e45f7e977112a7e63593820dbec1ec738a24f93c",
+            "b137985ff484fb600db93107c77b0365c80d78f5b429ded0fd97361d077999eb",
+            "36642e73c2540ab121e3a6bf9545b0a24982cd830eb13d3cd19de3ce6c021ec1"
+        };
+        bool passed = true;
+        uint8_t leaves[3 * SHA256_SIZE], root[SHA256_SIZE];
+        printf("Testing section_digest and merkle_root...\n");
+        for (i = 0; i < 3; i++)
+            section_digest("abc" + i, 1, leaves + i * SHA256_SIZE);
+        // a single section's digest is its root, two are hashed together and
+        // a third is carried up to be hashed with them
+        for (i = 0; passed && i < 3; i++)
+            passed = merkle_root(leaves, i + 1, root) == 0
+                && digest_is(root, roots[i]);
+        if (passed)
+            printf("PASSED\n");
+        else
+            printf("FAILED: %d sections\n", i);
+    }
+    {
+        bool passed = true;
+        int next = 0, oldest = 0;
+        printf("Testing ring_claim and ring_peek...\n");
+        ring_s* ring = ring_new(3, sizeof(int));   // rounded up to 4
+        passed = ring != NULL && ring_peek(ring, 0) == NULL;
+
+        // Fill it a little further each time round, so that where it is full
+        // moves across the end of the slots
+        for (i = 0; passed && i < 50; i++) {
+            int* slot;
+            while ((slot = ring_claim(ring)) != NULL) {
+                *slot = next++;
+                ring_publish(ring);
+            }
+            passed = next - oldest == 4;
+            for (int n = 0; passed && n < 1 + i % 4; n++) {
+                slot = ring_peek(ring, 0);
+                passed = slot && *slot == oldest++;
+                ring_release(ring);
+            }
+        }
+        while (passed && oldest < next) {
+            int* slot = ring_peek(ring, 0);
+            passed = slot && *slot == oldest++;
+            ring_release(ring);
+        }
+        passed = passed && ring_peek(ring, 1) == NULL;
+        if (ring)
+            ring_free(ring);
+        if (passed)
+            printf("PASSED\n");
+        else
+            printf("FAILED: i = %d, slot %d\n", i - 1, oldest - 1);
+    }
+#ifdef HAVE_SHMRING
+    {
+        bool passed = true;
+        int next = 0, oldest = 0, wraps = 0;
+        printf("Testing shmring_claim and shmring_peek...\n");
+        // Packets of 8 to 107 bytes, every third coming to less than was
+        // claimed for it, in a ring too small for more than a few of them
+        #define CLAIMED(id) (8 + (id) * 37 % 100)
+        #define PUBLISHED(id) ((id) % 3 ? CLAIMED(id) : CLAIMED(id) / 2 + 4)
+        shmring_s* producer = shmring_new(256);
+        shmring_s* consumer = producer ? shmring_attach(
+            dup(shmring_memfd(producer)), dup(shmring_eventfd(producer))) : NULL;
+        passed = consumer != NULL;
+        char* last = NULL;
+
+        // Take out a different number of packets each time round, so that
+        // the ring is full at different places, and the packets that do not
+        // fit before the end go back to the start after a WRAP record
+        for (i = 0; passed && i < 100; i++) {
+            char* packet;
+            while ((packet = shmring_claim(producer, CLAIMED(next))) != NULL) {
+                if (packet < last)
+                    wraps++;
+                last = packet;
+                memset(packet, next & 0xFF, PUBLISHED(next));
+                shmring_publish(producer, PUBLISHED(next));
+                next++;
+            }
+            passed = !shmring_fits(producer, CLAIMED(next)) && next > oldest;
+            for (int n = 0; passed && n < 1 + i % 3 && oldest < next; n++) {
+                int length;
+                packet = shmring_peek(consumer, &length);
+                passed = packet && length == PUBLISHED(oldest)
+                    && packet[0] == (char)(oldest & 0xFF)
+                    && packet[length - 1] == (char)(oldest & 0xFF);
+                shmring_release(consumer);
+                oldest++;
+            }
+        }
+        while (passed && oldest < next) {
+            int length;
+            char* packet = shmring_peek(consumer, &length);
+            passed = packet && length == PUBLISHED(oldest)
+                && packet[0] == (char)(oldest & 0xFF);
+            shmring_release(consumer);
+            oldest++;
+        }
+        passed = passed && wraps > 0 && shmring_peek(consumer, &i) == NULL;
+        #undef CLAIMED
+        #undef PUBLISHED
+        shmring_free(consumer);
+        shmring_free(producer);
+        if (passed)
+            printf("PASSED\n");
+        else
+            printf("FAILED: packet %d, wrapped %d times\n", oldest - 1, wraps);
+    }
+#endif
+    {
+        // Few buckets for many keys, so that evicting takes slots out of
+        // the middle of long chains
+        const int num_slots = 16, num_keys = 64;
+        bool passed = true;
+        printf("Testing symcache...\n");
+        symcache_s* cache = symcache_new(num_slots * 64, 64);
+        passed = cache != NULL;
+
+        // what should be cached: when each key was last used, 0 if it is not
+        int last_used[num_keys];
+        memset(last_used, 0, sizeof last_used);
+        int num_cached = 0;
+        uint64_t gets = 0, expected_hits = 0, hits, misses;
+        for (i = 1; passed && i <= 20000; i++) {
+            int k = (i <= num_slots) ? i - 1 : rand() % num_keys;
+            symcache_key_s key = { 1, k, k % 3, 1024 };
+            int* slot = symcache_get(cache, &key);
+            gets++;
+            if (last_used[k]) {
+                expected_hits++;
+                passed = slot && *slot == k;
+            } else {
+                passed = !slot;
+                if (num_cached == num_slots) {
+                    int oldest = -1;
+                    for (int j = 0; j < num_keys; j++)
+                        if (last_used[j] && (oldest < 0
+                                || last_used[j] < last_used[oldest]))
+                            oldest = j;
+                    last_used[oldest] = 0;
+                    num_cached--;
+                }
+                slot = symcache_put(cache, &key);
+                *slot = k;
+                num_cached++;
+            }
+            last_used[k] = i;
+            for (int j = 0; passed && j < num_keys; j++) {
+                symcache_key_s other = { 1, j, j % 3, 1024 };
+                passed = !symcache_contains(cache, &other) == !last_used[j];
+            }
+        }
+        if (passed) {
+            symcache_stats(cache, &hits, &misses);
+            passed = hits == expected_hits && hits + misses == gets;
+        }
+        symcache_free(cache);
+        if (passed)
+            printf("PASSED\n");
+        else
+            printf("FAILED: i = %d\n", i - 1);
+    }
+    {
+        // More keys than buckets, so that every eviction takes a key out
+        // of a chain the others share
+        const int num_slots = 4;
+        bool passed = true;
+        printf("Testing symcache eviction order...\n");
+        symcache_s* cache = symcache_new(num_slots * 64, 64);
+        passed = cache != NULL;
+        symcache_key_s keys[12];
+        for (i = 0; i < 12; i++)
+            keys[i] = (symcache_key_s) { 7, i, 0, 1024 };
+
+        // each put past num_slots evicts the oldest, leaving the last four
+        for (i = 0; passed && i < 12; i++) {
+            passed = symcache_put(cache, keys + i) != NULL;
+            for (int j = 0; passed && j <= i; j++)
+                passed = !symcache_contains(cache, keys + j)
+                         == (j <= i - num_slots);
+        }
+        // 8 9 10 11 from the oldest, getting 8 moves it past the others
+        passed = passed && symcache_get(cache, keys + 8) != NULL
+            && symcache_put(cache, keys + 0) && symcache_put(cache, keys + 1)
+            && symcache_contains(cache, keys + 8)
+            && !symcache_contains(cache, keys + 9)
+            && !symcache_contains(cache, keys + 10)
+            && symcache_put(cache, keys + 2)
+            && !symcache_contains(cache, keys + 11)
+            && symcache_contains(cache, keys + 8)
+            && symcache_put(cache, keys + 3)
+            && !symcache_contains(cache, keys + 8);
+        for (int j = 0; passed && j < 4; j++)
+            passed = symcache_contains(cache, keys + j);
+        symcache_free(cache);
+        if (passed)
+            printf("PASSED\n");
+        else
+            printf("FAILED: i = %d\n", i);
+    }
+    {
+        // The last section is short
+        const int blk_size = 64, section_size = 8, num_symbols = 20;
+        const int num_sections = 5;
+        bool passed = true;
+        int section = 0, id = 0;
+        printf("Testing store_write and store_open...\n");
+        char input[blk_size * section_size * num_sections - 13];
+        for (i = 0; i < sizeof input; i++)
+            input[i] = rand();
+        char filename[] = "/tmp/fountain_test_store_XXXXXX";
+        int fd = mkstemp(filename);
+        if (fd >= 0)
+            close(fd);
+        uint32_t nonce = rand() | 1;
+
+        passed = fd >= 0 && store_write(filename, input, sizeof input,
+                                        blk_size, section_size, num_symbols,
+                                        nonce) == 0;
+        store_s* store = passed ? store_open(filename) : NULL;
+        passed = store && store->blk_size == blk_size
+            && store->section_size == section_size
+            && store->num_sections == num_sections
+            && store->filesize == sizeof input
+            && store->wire.nonce == nonce;
+        for (section = 0; passed && section < num_sections; section++) {
+            for (id = 0; passed && id < num_symbols; id++) {
+                int length;
+                const char* packet = store_packet(store, section, id, &length);
+                buffer_s buf = { .length = length, .buffer = (char*)packet };
+                uint32_t symbol_id;
+                passed = packet && check_fountain(buf, store->wire)
+                    && packed_fountain_section(buf, store->wire) == section
+                    && packed_fountain_symbol_id(buf, store->wire,
+                                                 &symbol_id) == 0
+                    && symbol_id == id;
+            }
+            int length;
+            passed = passed && !store_packet(store, section, id, &length);
+        }
+        store_close(store);
+
+        // A flipped byte in the header, the index or a packet is caught
+        FILE* f = passed ? fopen(filename, "r+b") : NULL;
+        const long offsets[] = {
+            20, STORE_HEADER_SIZE + 2 * STORE_INDEX_SIZE + 9,
+            STORE_HEADER_SIZE + num_sections * STORE_INDEX_SIZE + 1000
+        };
+        for (i = 0; f && passed && i < 3; i++) {
+            int byte;
+            passed = fseek(f, offsets[i], SEEK_SET) == 0
+                && (byte = fgetc(f)) != EOF
+                && fseek(f, offsets[i], SEEK_SET) == 0
+                && fputc(byte ^ 0x10, f) != EOF && fflush(f) == 0;
+            store = passed ? store_open(filename) : NULL;
+            passed = passed && !store;
+            store_close(store);
+            passed = passed && fseek(f, offsets[i], SEEK_SET) == 0
+                && fputc(byte, f) != EOF && fflush(f) == 0;
+        }
+        passed = passed && f;
+        if (f)
+            fclose(f);
+        // and once put back it opens again
+        store = passed ? store_open(filename) : NULL;
+        passed = passed && store;
+        store_close(store);
+        remove(filename);
+        if (passed)
+            printf("PASSED\n");
+        else
+            printf("FAILED: section = %d, id = %d, corrupted = %d\n",
+                   section, id, i);
+    }
 }
 #endif
 
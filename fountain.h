@@ -22,6 +22,7 @@ typedef struct fountain_s {
 #else
     uint32_t* block_set; // Use bitset on receiving end
 #endif
+    uint32_t symbol_id; // what the seed was made from, see symbol_seed
 } fountain_s;
 
 /* We don't want to send the pointers across the network as they will have
@@ -29,13 +30,54 @@ typedef struct fountain_s {
  */
 #define FTN_HEADER_SIZE (sizeof(int32_t) + sizeof(int16_t) + sizeof(uint16_t) + sizeof(uint64_t))
 
-/* include the checksum at the beginning */
-#define MAX_PACKED_FTN_SIZE (sizeof(int16_t) + FTN_HEADER_SIZE + MAX_BLOCK_SIZE)
+/* How packets are protected. The client says which it can check when it asks
+ * for the file info and the server answers with the one it will use, old
+ * peers that say nothing get Fletcher16 */
+#define FTN_CHECKSUM_FLETCHER16 0
+#define FTN_CHECKSUM_CRC32C     1
+#define FTN_CHECKSUM_SIZE(checksum) \
+    ((checksum) == FTN_CHECKSUM_CRC32C ? sizeof(uint32_t) : sizeof(uint16_t))
+
+/* How the header is laid out, agreed the same way as the checksum.
+ *
+ * v1 is the checksum followed by the first FTN_HEADER_SIZE bytes of fountain_s
+ * as they are in memory, so in the sender's byte order.
+ *
+ * v2 is packed byte by byte, multi-byte fields big-endian:
+ *   version (2) | codec | section as a LEB128 varint | symbol id (u32) |
+ *   checksum over everything before and after it | payload
+ * The seed follows from the symbol id and the stream's nonce, the number of
+ * blocks from the seed and the block size from the length of the packet, so
+ * none of them are sent. With CRC32C that comes to 11-13 bytes ahead of the
+ * payload where v1 takes 20, with Fletcher16 to 9-11 where v1 takes 18.
+ */
+#define FTN_WIRE_V1 1
+#define FTN_WIRE_V2 2
+#define FTN_CODEC_LT 0  /* the block selection in fountain.c */
+#define FTN_V2_HEADER_SIZE (2 * sizeof(uint8_t) + 3 + sizeof(uint32_t))
+
+typedef struct ftn_wire_s {
+    int version;    /* FTN_WIRE_* */
+    int checksum;   /* FTN_CHECKSUM_* */
+    uint32_t nonce; /* the stream v2 symbol ids are from */
+} ftn_wire_s;
+
+/* include the checksum, for v2 this is the most the header can take */
+#define PACKED_FTN_HEADER_SIZE(wire) \
+    (FTN_CHECKSUM_SIZE((wire).checksum) + ((wire).version == FTN_WIRE_V2 \
+                                           ? FTN_V2_HEADER_SIZE : FTN_HEADER_SIZE))
+#define PACKED_FTN_SIZE(wire, blk_size) \
+    (PACKED_FTN_HEADER_SIZE(wire) + (blk_size))
+#define MAX_PACKED_FTN_HEADER_SIZE \
+    (FTN_CHECKSUM_SIZE(FTN_CHECKSUM_CRC32C) + FTN_HEADER_SIZE)
+#define MAX_PACKED_FTN_SIZE (MAX_PACKED_FTN_HEADER_SIZE + MAX_BLOCK_SIZE)
 
 typedef struct packethold_s {
     int num_packets;
     int num_slots;
+    int blk_size;
     fountain_s * fountain; /**< an array of held packets */
+    char* strings; /* payloads of the held packets, one per slot */
     size_t offset;
     char* mark; /* bitset for mark algorithm */
     char* deleted; /* bitset for marking packets as deleted */
@@ -59,6 +101,14 @@ typedef struct decodestate_s {
     int packets_so_far;
     char* filename; /* must be in wb+ mode */
     FILE* fp;
+    /* Echelon basis of every block set received, row i has its lowest bit
+       at i, so rank tells us how far we are from being able to decode */
+#if defined(__x86_64__) || defined(__arm64__)
+    uint64_t* basis;
+#else
+    uint32_t* basis;
+#endif
+    int rank;
 } decodestate_s;
 
 typedef struct memdecodestate_s {
@@ -83,6 +133,25 @@ extern char* memdecodestate_filename;
 fountain_s* make_fountain(const char* string, int blk_size, size_t length, int section, int section_size) __malloc; /* allocs memory */
 fountain_s* fmake_fountain(FILE* f, int blk_size, int section, int section_size) __malloc; /* allocs memory */
 void free_fountain(fountain_s* ftn);
+
+/**
+ * Same as make_fountain but without allocating anything, for sending the
+ * fountain straight away, and for the given symbol of a stream rather than a
+ * random one. A packet of a single whole block has its string point into
+ * string itself, otherwise the blocks are xored together into scratch, which
+ * must be blk_size bytes. The block set is not filled in.
+ */
+void encode_fountain(fountain_s* ftn, char* scratch, const char* string,
+        int blk_size, size_t length, int section, int section_size,
+        uint32_t nonce, uint32_t symbol_id);
+
+/**
+ * The seed of a symbol in the stream given by nonce. Symbol ids below 2^31
+ * all get different seeds within a section, so a sender that counts them up
+ * never repeats itself the way random seeds can, and can pick up from any id.
+ * A nonce of 0 takes the id as the seed itself.
+ */
+uint64_t symbol_seed(uint32_t nonce, int section, uint32_t symbol_id);
 int cmp_fountain(fountain_s* ftn1, fountain_s* ftn2);
 char* decode_fountain(const char* string, int blk_size);
 void print_fountain(const fountain_s * ftn);
@@ -112,7 +181,15 @@ typedef struct buffer_s {
 
    returns A pointer to the buffer
 */
-buffer_s pack_fountain(fountain_s* ftn);
+buffer_s pack_fountain(fountain_s* ftn, ftn_wire_s wire);
+
+/* Pack just the checksum and header, at most PACKED_FTN_HEADER_SIZE bytes,
+   so that the payload can be sent from wherever it is, e.g. with sendmsg.
+   The checksum still covers the payload.
+
+   returns the size of the header
+*/
+int pack_fountain_header(fountain_s* ftn, ftn_wire_s wire, char* header);
 
 /* Upack the fountain from it's serialized form.
    This does allocate memory because free_fountain will expect the inner
@@ -120,16 +197,57 @@ buffer_s pack_fountain(fountain_s* ftn);
 
    returns A pointer to the deserialized fountain or NULL on failure
 */
-fountain_s* unpack_fountain(buffer_s packet, int section_size_in_blocks) __malloc;
+fountain_s* unpack_fountain(buffer_s packet, ftn_wire_s wire,
+                            int section_size_in_blocks) __malloc;
+
+/* Verify the checksum of a packed fountain.
+   returns 1 if the packet is intact, 0 otherwise
+*/
+int check_fountain(buffer_s packet, ftn_wire_s wire);
+
+/* Same as unpack_fountain for a packet that has already been through
+   check_fountain */
+fountain_s* unpack_checked_fountain(buffer_s packet, ftn_wire_s wire,
+                                    int section_size_in_blocks) __malloc;
+
+/* Unpack a packet that has already been through check_fountain without
+   allocating anything. ftn is filled in as a view onto the packet: its string
+   points into the packet buffer and its block set is regenerated into
+   block_set, which must come from blockset_scratch_new. The decoder only
+   copies the payload if it has to hold on to it, so the packet buffer can be
+   reused as soon as decoding returns.
+
+   returns 0 on success or -1 if the header is not one we can decode
+*/
+int view_fountain(buffer_s packet, ftn_wire_s wire, int section_size_in_blocks,
+                  fountain_s* ftn, void* block_set);
+
+/* Room for the block set of any packet in a section, for view_fountain */
+void* blockset_scratch_new(int section_size_in_blocks) __malloc;
+void blockset_scratch_free(void* block_set);
+
+/* The section a packed fountain belongs to, read without unpacking it.
+   returns -1 if the packet is too short to have one
+*/
+int packed_fountain_section(buffer_s packet, ftn_wire_s wire);
+
+/* The symbol id of a packed v2 fountain, read without unpacking it.
+   returns 0 or -1 if the packet has none
+*/
+int packed_fountain_symbol_id(buffer_s packet, ftn_wire_s wire,
+                              uint32_t* symbol_id);
 
 /* ============ packethold_s functions  ==================================== */
 // num_blocks in the number in the result - not the length of the hold
-packethold_s* packethold_new(int num_blocks) __malloc; /* allocs memory */
+packethold_s* packethold_new(int num_blocks, int blk_size) __malloc; /* allocs memory */
 void packethold_free(packethold_s* hold);
-fountain_s* packethold_remove(packethold_s* hold, int pos, fountain_s* output); /* allocs memory*/
 
-/* adds a fountain to the end of the hold, making full copy so the orig can
-   be freed later if so desired.
+/* The removed packet's string still points into the hold, it stays valid
+   until the next packethold_add or packethold_collect_garbage */
+fountain_s* packethold_remove(packethold_s* hold, int pos, fountain_s* output);
+
+/* adds a fountain to the end of the hold, copying its payload and block set
+   into the hold's own storage so the orig can be freed or reused.
    returns 0 on success
    returns REALLOC_ERR if unable to reallocate more memory for the hold
    returns ALLOC_ERR if unable to allocate to make a copy of the fountain
@@ -155,4 +273,9 @@ decodestate_s* decodestate_new(int blk_size, int num_blocks) __malloc;
 void decodestate_free(decodestate_s* state);
 int decodestate_is_decoded(decodestate_s* state);
 
+/* The number of linearly independent packets the section still needs before
+   it can be decoded: num_blocks - rank(decoded blocks + hold). Callers should
+   add a margin on top as not every new packet will be independent */
+int decodestate_symbols_needed(decodestate_s* state);
+
 #endif /* __FOUNTAIN_H__ */
@@ -19,9 +19,31 @@ typedef struct packet_s {
 #define MAGIC_REQUEST_INFO  ('R'<<24 | 'I'<<16 | 'N'<<8 | 'F')
 typedef struct info_request_s {
     int32_t magic;
+    uint16_t checksums;     // 1 << FTN_CHECKSUM_* for each the client can check
+    uint16_t versions;      // 1 << FTN_WIRE_* for each header it can parse
+    uint16_t flags;         // REQUEST_FLAG_*
+    uint16_t mtu;           // of the path to the server, 0 if not known
+    uint16_t start;         // sections to start sending from the first, see
+                            // INFO_FLAG_STARTED, 0 to wait for a wait signal
+    uint16_t start_overhead; // permille of a section's blocks to send of each
+    uint32_t token;         // from the file info of an earlier download from
+                            // this server, 0 if we have none
     // Leave room to expand later
 } info_request_s;
 
+// A request that sets start is padded out to this many bytes with zeros, as
+// what the server starts on is bounded by the size of the request
+#define INFO_REQUEST_PADDED 1200
+
+// v2 symbol ids count up from the nonce in the file info, without it they are
+// random and taken as the seed itself
+#define REQUEST_FLAG_NONCE  0x0001
+// the client can join a multicast group to receive its packets
+#define REQUEST_FLAG_MULTICAST 0x0002
+// and can listen to the group without asking for anything, see
+// INFO_FLAG_CAROUSEL
+#define REQUEST_FLAG_CAROUSEL 0x0004
+
 #define MAGIC_INFO  ('I'<<24 | 'N'<<16 | 'F'<<8 | 'O')
 //
 // The file information that is sent
@@ -31,19 +53,128 @@ typedef struct file_info_s {
     int16_t blk_size;
     int32_t filesize;       // The actual size in bytes
     char filename[256];
+    uint16_t checksum;      // FTN_CHECKSUM_* on every packet from here on,
+                            // after filename so that old clients ignore it
+    uint8_t merkle_root[32]; // over the section digests, 0 if not served
+    uint16_t version;       // FTN_WIRE_* of every packet, 0 means v1
+    uint32_t nonce;         // the client's stream of v2 symbol ids
+    uint32_t group;         // multicast address packets come from, as in
+                            // s_addr so already in network order, 0 if unicast
+    uint16_t group_port;
+    uint16_t flags;         // INFO_FLAG_*
+    uint32_t cookie;        // to echo in requests, which shows the server that
+                            // we get what it sends us, 0 if not wanted
+    uint16_t start_packets; // see INFO_FLAG_STARTED
+    uint32_t token;         // for our address, to send in later info requests
 } file_info_s;
 
+// The group streams every section in turn whatever anyone asks for, so there
+// is nothing to send but listen until every section is decoded. The server
+// sends this file info and the digests to the group every so often among the
+// packets, for receivers that cannot reach it at all.
+#define INFO_FLAG_CAROUSEL  0x0001
+// The server keeps track of the sections each client has, see MAGIC_DONE
+#define INFO_FLAG_DONE      0x0002
+// The server has started on the sections the info request asked for, as if
+// the client had sent a wait signal for sections 0 to start - 1 (or the last
+// section if that comes first) with START_CAPACITY packets of each, until
+// they come to start_packets. It follows this file info with the digests of
+// every section, which fit in the one message, and then the packets, so that
+// a small file arrives a round trip or two sooner.
+//
+// Unless the request carries the token the server gave that address before,
+// nothing yet shows that the client is at the address the request came from.
+// Then all of that together is held to START_AMPLIFICATION times the bytes
+// of the request. The overhead is held to START_MAX_OVERHEAD either way.
+#define INFO_FLAG_STARTED   0x0004
+
+#define START_CAPACITY(section_size, overhead) \
+    (((section_size) * (overhead) + 999) / 1000)
+#define START_AMPLIFICATION 3
+#define START_MAX_OVERHEAD  1250
+
+//
+// Sent by the client for the SHA-256 digests of a run of sections, which it
+// checks against the Merkle root from the file info and then checks each
+// section against as soon as it is decoded
+#define MAGIC_REQUEST_DIGESTS ('R'<<24 | 'D'<<16 | 'G'<<8 | 'S')
+typedef struct digest_request_s {
+    int32_t magic;
+    uint16_t first;
+    uint16_t count;
+    uint32_t cookie;        // from the file info, left out by older clients
+} digest_request_s;
+
+#define MAGIC_DIGESTS ('D'<<24 | 'G'<<16 | 'S'<<8 | 'T')
+#define MAX_DIGESTS_PER_MSG 32
+typedef struct digests_s {
+    int32_t magic;
+    uint16_t first;
+    uint16_t count;
+    uint8_t digests[0][32];
+} digests_s;
+
+#define DIGESTS_SIZE(count) (sizeof(digests_s) + (count) * 32)
+
 //
 // This is sent by the client when it would like to receive a burst
-// transmission from the server
+// transmission from the server. The client also reports how the previous
+// burst fared so that the server can pace the next one.
 #define MAGIC_WAITING ('W'<<24 | 'A'<<16 | 'I'<<8 | 'T')
 
 typedef struct wait_signal_s {
     int32_t magic;
     uint16_t num_sections;
+    uint16_t loss;          // permille of the last request that never arrived
+    uint16_t delay;         // ms from the last request to its first packet
     struct { uint16_t section; uint16_t capacity; } sections[0];
 } wait_signal_s;
 
+#define WAIT_SIGNAL_SIZE(num_sections) \
+    (sizeof(wait_signal_s) + (num_sections) * 2 * sizeof(uint16_t))
+
+// Members of a multicast group follow the sections with a uint32_t for each,
+// the id after the last group symbol they got of it, so that the server can
+// leave out what is already on its way to them
+#define WAIT_SIGNAL_SEEN_SIZE(num_sections) \
+    (WAIT_SIGNAL_SIZE(num_sections) + (num_sections) * sizeof(uint32_t))
+
+// Clients given a cookie in the file info end each wait signal with it, as a
+// uint32_t after everything else. Until it does the server treats the client
+// as a possibly forged source address and sends it very little.
+
+//
+// Sent by the client as soon as sections it asked for are decoded, so that the
+// server drops whatever it still has queued for them. Every section before
+// first is done, as is first + i for each bit i set in bits, low bit first.
+// Only sent to servers that set INFO_FLAG_DONE.
+#define MAGIC_DONE ('D'<<24 | 'O'<<16 | 'N'<<8 | 'E')
+#define MAX_DONE_BITS 2048
+typedef struct done_signal_s {
+    int32_t magic;
+    uint16_t first;
+    uint16_t num_bits;
+    uint8_t bits[0];
+} done_signal_s;
+
+#define DONE_SIGNAL_SIZE(num_bits) \
+    (sizeof(done_signal_s) + ((num_bits) + 7) / 8)
+
+//
+// Sent by a client on the same host as the server over the server's unix
+// socket, with a ring of shared memory and an eventfd as SCM_RIGHTS, for the
+// server to put the client's packets in from then on rather than send them,
+// see shmring.h. Everything else still goes over UDP. The client is the one
+// at address and port that the cookie in its file info was for.
+#define MAGIC_RING ('R'<<24 | 'I'<<16 | 'N'<<8 | 'G')
+typedef struct ring_request_s {
+    int32_t magic;
+    uint32_t address;       // as in s_addr so already in network order
+    uint16_t port;          // also in network order
+    uint16_t pad;
+    uint32_t cookie;
+} ring_request_s;
+
 // Test for GCC 4.9.*
 #if defined(__GNUC__) && GCC_VERSION >= 40900 \
     || (!defined(__GNUC__) && __STDC_VERSION__ >= 201112L)
@@ -9,6 +9,8 @@
 #   include "asprintf.h"
 #endif
 #include "fountain.h"
+#include "mapping.h" // map_file_read unmap_file
+#include "store.h"
 #include "dbg.h"
 
 #ifdef _WIN32
@@ -17,6 +19,14 @@
 #   define ENDL "\n"
 #endif
 
+/* What the server picks by default for a 1500 byte MTU, so that a store made
+   without saying otherwise can be served as it is */
+#define STORE_BLOCK_SIZE \
+    ((1500 - 28 - MAX_PACKED_FTN_HEADER_SIZE) / 16 * 16)
+#define STORE_SECTION_SIZE 20
+#define STORE_MAX_SECTIONS UINT16_MAX
+#define STORE_SYMBOLS(section_size) (2 * (section_size))
+
 // ----- types ------
 typedef fountain_s* (*fountain_src)(void);
 
@@ -25,6 +35,10 @@ static char* infilename = NULL;
 static char* outfilename = NULL;
 static int blk_size = 128;
 static char* meminput = "Hello there you jammy little bugger!";
+static char* storename = NULL;
+static int blk_size_given = 0;
+static int store_section_size = 0; /* of a store, 0 to grow with the file */
+static int store_symbols = 0;  /* per section, 0 for STORE_SYMBOLS */
 
 static int filesize(char const * filename) {
     struct stat st;
@@ -99,10 +113,48 @@ free_state:
     return handle_error(result, err_str);
 }
 
+/*
+ * Encode the input file into a store for the server to send from, with the
+ * sizes the server would pick unless told otherwise
+ */
+static int make_store() {
+    int length = filesize(infilename);
+    if (length < 0) return handle_error(length, &infilename);
+    if (!blk_size_given)
+        blk_size = STORE_BLOCK_SIZE;
+    if (store_section_size <= 0) {
+        int per_section = (length + STORE_MAX_SECTIONS - 1)
+                          / STORE_MAX_SECTIONS;
+        store_section_size = (per_section + blk_size - 1) / blk_size;
+        if (store_section_size < STORE_SECTION_SIZE)
+            store_section_size = STORE_SECTION_SIZE;
+    }
+    if (store_symbols <= 0)
+        store_symbols = STORE_SYMBOLS(store_section_size);
+
+    char* data = map_file_read(infilename);
+    if (!data) return handle_error(ERR_MAP, &infilename);
+
+    // the stream the store's symbols are from, never 0 as that means none
+    uint32_t nonce;
+    do {
+        nonce = (uint32_t)rand() << 16 ^ rand();
+    } while (nonce == 0);
+
+    int result = store_write(storename, data, length, blk_size,
+                             store_section_size, store_symbols, nonce);
+    unmap_file(data);
+    if (result == 0)
+        printf("%d symbols of each section of %d blocks of %d bytes "
+               "written to %s" ENDL, store_symbols, store_section_size,
+               blk_size, storename);
+    return result;
+}
+
 /* Program entry point */
 int main(int argc, char** argv) {
     int c;
-    while ( (c = getopt(argc, argv, "f:o:b:")) != -1) {
+    while ( (c = getopt(argc, argv, "f:o:b:n:s:S:")) != -1) {
         switch (c) {
             case 'f':
                 infilename = optarg;
@@ -112,6 +164,16 @@ int main(int argc, char** argv) {
                 break;
             case 'b':
                 blk_size = atoi(optarg);
+                blk_size_given = 1;
+                break;
+            case 'n':
+                store_symbols = atoi(optarg);
+                break;
+            case 's':
+                store_section_size = atoi(optarg);
+                break;
+            case 'S':
+                storename = optarg;
                 break;
             case '?':
                 exit(1);
@@ -124,6 +186,17 @@ int main(int argc, char** argv) {
     /* seed random number generation */
     srand(time(NULL));
 
+    if (storename) {
+        int error;
+        if (!infilename) {
+            log_err("A store is made from a file, give it with -f");
+            return 1;
+        }
+        if ((error = make_store()) < 0) {
+            handle_error(error, &storename); return 1; }
+        return 0;
+    }
+
     fountain_src ftn_src = NULL;
     if (infilename)
         ftn_src = from_file;
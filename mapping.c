@@ -145,6 +145,8 @@ void unmap_file(char* map_address) {
             while (++i < num_mappings) {
                 mappings[i - 1] = mappings[i];
             }
+            num_mappings--;
+            return;
         }
     }
 }
@@ -44,6 +44,7 @@ int WSAAPI WSAPoll(
 #   include <netinet/in.h>
 #   include <arpa/inet.h>
 #   include <poll.h> /* Included here since the win32 counterpart is also */
+#   include <unistd.h> /* close */
 #endif
 
 /* Here we define the constant names used in the windows libraries so that
@@ -64,4 +65,28 @@ int WSAAPI WSAPoll(
 #   define INVALID_SOCKET -1
 #endif
 
+/*
+ * The MTU of the path to address as far as the kernel knows, from the route
+ * or from path MTU discovery, or 0 if it cannot tell us
+ */
+static inline int path_mtu(const struct sockaddr_in* address)
+{
+#if defined(IP_MTU) && defined(IP_MTU_DISCOVER)
+    SOCKET probe = socket(AF_INET, SOCK_DGRAM, 0);
+    if (probe == INVALID_SOCKET)
+        return 0;
+    int mtu = IP_PMTUDISC_DO;
+    socklen_t len = sizeof mtu;
+    setsockopt(probe, IPPROTO_IP, IP_MTU_DISCOVER, &mtu, sizeof mtu);
+    if (connect(probe, (const struct sockaddr*)address, sizeof *address) < 0
+            || getsockopt(probe, IPPROTO_IP, IP_MTU, &mtu, &len) < 0)
+        mtu = 0;
+    closesocket(probe);
+    return mtu;
+#else
+    (void)address;
+    return 0;
+#endif
+}
+
 #endif /* __NETWORKING_H__ */
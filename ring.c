@@ -0,0 +1,123 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "ring.h"
+
+#define CACHE_LINE 64
+
+struct ring_s {
+    /* head and tail are on their own cache lines so that the producer and
+       consumer don't keep stealing each other's */
+    _Atomic size_t head;    /* next slot to publish, only producer writes */
+    char pad0[CACHE_LINE - sizeof(size_t)];
+    _Atomic size_t tail;    /* next slot to release, only consumer writes */
+    char pad1[CACHE_LINE - sizeof(size_t)];
+    size_t mask;
+    size_t slot_size;
+    char* slots;
+    _Atomic int waiting;    /* the consumer is asleep on nonempty */
+    pthread_mutex_t lock;
+    pthread_cond_t nonempty;
+};
+
+ring_s* ring_new(int num_slots, int slot_size) {
+    ring_s* ring = calloc(1, sizeof *ring);
+    if (!ring) return NULL;
+
+    size_t n = 1;
+    while (n < num_slots) n <<= 1;
+    ring->mask = n - 1;
+    ring->slot_size = (slot_size + CACHE_LINE - 1) & ~(CACHE_LINE - 1);
+
+    ring->slots = malloc(n * ring->slot_size);
+    if (!ring->slots) goto free_ring;
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+#if !defined(__APPLE__) && !defined(_WIN32)
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+#endif
+    pthread_cond_init(&ring->nonempty, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&ring->lock, NULL);
+
+    return ring;
+free_ring:
+    free(ring);
+    return NULL;
+}
+
+void ring_free(ring_s* ring) {
+    pthread_cond_destroy(&ring->nonempty);
+    pthread_mutex_destroy(&ring->lock);
+    free(ring->slots);
+    free(ring);
+}
+
+void* ring_claim(ring_s* ring) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail > ring->mask)
+        return NULL;
+    return ring->slots + (head & ring->mask) * ring->slot_size;
+}
+
+void ring_publish(ring_s* ring) {
+    // seq_cst so that we cannot miss a consumer that has just gone to sleep
+    atomic_fetch_add(&ring->head, 1);
+    if (atomic_load(&ring->waiting)) {
+        pthread_mutex_lock(&ring->lock);
+        pthread_cond_signal(&ring->nonempty);
+        pthread_mutex_unlock(&ring->lock);
+    }
+}
+
+static void deadline_after(struct timespec* ts, int timeout_ms) {
+#if !defined(__APPLE__) && !defined(_WIN32)
+    clock_gettime(CLOCK_MONOTONIC, ts);
+#else
+    clock_gettime(CLOCK_REALTIME, ts);
+#endif
+    ts->tv_sec += timeout_ms / 1000;
+    ts->tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec += 1;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+void* ring_peek(ring_s* ring, int timeout_ms) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (atomic_load_explicit(&ring->head, memory_order_acquire) == tail) {
+        if (timeout_ms == 0)
+            return NULL;
+
+        struct timespec deadline;
+        deadline_after(&deadline, timeout_ms);
+
+        pthread_mutex_lock(&ring->lock);
+        atomic_store(&ring->waiting, 1);
+        int timed_out = 0;
+        while (atomic_load(&ring->head) == tail && !timed_out) {
+            if (timeout_ms < 0)
+                pthread_cond_wait(&ring->nonempty, &ring->lock);
+            else
+                timed_out = pthread_cond_timedwait(&ring->nonempty,
+                                                   &ring->lock, &deadline);
+        }
+        atomic_store(&ring->waiting, 0);
+        pthread_mutex_unlock(&ring->lock);
+
+        if (atomic_load_explicit(&ring->head, memory_order_acquire) == tail)
+            return NULL;
+    }
+    return ring->slots + (tail & ring->mask) * ring->slot_size;
+}
+
+void ring_release(ring_s* ring) {
+    atomic_fetch_add_explicit(&ring->tail, 1, memory_order_release);
+}
@@ -0,0 +1,32 @@
+#ifndef __RING_H__
+#define __RING_H__
+
+#include "platform.h"
+
+/*
+ * A lock-free single-producer single-consumer ring of fixed-size slots.
+ *
+ * The producer fills the slot returned by ring_claim in place and hands it
+ * over with ring_publish. The consumer works on the slot returned by
+ * ring_peek in place and hands it back with ring_release. A consumer that
+ * finds the ring empty may sleep until the producer publishes, which is the
+ * only time a lock is taken.
+ */
+typedef struct ring_s ring_s;
+
+/* num_slots is rounded up to a power of 2 */
+ring_s* ring_new(int num_slots, int slot_size) __malloc;
+void ring_free(ring_s* ring);
+
+/* returns the next free slot or NULL if the ring is full */
+void* ring_claim(ring_s* ring);
+void ring_publish(ring_s* ring);
+
+/*
+ * returns the oldest published slot, waiting up to timeout_ms for one (-1 to
+ * wait forever), or NULL if there is none
+ */
+void* ring_peek(ring_s* ring, int timeout_ms);
+void ring_release(ring_s* ring);
+
+#endif /* __RING_H__ */
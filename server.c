@@ -6,11 +6,27 @@
 #include <stdio.h>
 #include <stdlib.h> //memcpy
 #include <string.h>
+#include <stddef.h> //offsetof
 #include <inttypes.h>
 #include <time.h> //time
 #include <unistd.h> //getopt
 #include <getopt.h> //getopt_long
 #include <sys/stat.h>
+#include <pthread.h>
+#ifndef _WIN32
+#   include <sys/socket.h>
+#   include <sys/uio.h> // struct iovec
+#   include <errno.h>
+#endif
+#if defined(__linux__)
+#   include <sys/un.h> // clients handing us rings over a unix socket
+#   define HAVE_SENDMMSG
+#   define HAVE_PKTINFO // which interface a request came in on
+#   include <linux/errqueue.h> // zerocopy completions
+#   if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+#       define HAVE_ZEROCOPY
+#   endif
+#endif
 
 /* Windows doesn't seem to provide asprintf.h... */
 #ifdef _WIN32
@@ -21,37 +37,194 @@
 #include "dbg.h"
 #include "fountainprotocol.h" // msg definitions
 #include "mapping.h" // map_file unmap_file
+#include "timing.h" // monotonic_usec
+#include "cpus.h" // online_cpus
+#include "sha256.h" // section_digest merkle_root
+#include "bitset.h" // the sections a client is done with
+#include "symcache.h" // symcache_get symcache_put
+#include "store.h" // store_open store_packet
+#include "shmring.h" // shmring_attach shmring_claim
 
 #define LISTEN_PORT 2534
 #define LISTEN_IP "0.0.0.0"
 #define BUF_LEN 512
+#define RECV_LEN INFO_REQUEST_PADDED /* the longest message we read */
 #define BURST_SIZE 1000
+#define MAX_CLIENTS 256
+#define MAX_WAIT_SECTIONS \
+    ((BUF_LEN - sizeof(wait_signal_s)) / (2 * sizeof(uint16_t)))
+
+#define UDP_OVERHEAD    28  /* IPv4 + UDP headers on every packet */
+#define DEFAULT_MTU     1500
+#define BLOCK_ALIGN     16  /* so blocks can be halved for smaller paths */
+#define MIN_BLOCK_SIZE  64
+#define DEFAULT_SECTION_SIZE 20
+#define MAX_SECTION_BLOCKS 1024 /* most we grow sections to for large files */
+#define MAX_SECTIONS    UINT16_MAX
+#define INITIAL_RATE    (8 * 1024 * 1024)   /* bytes per second */
+#define MIN_RATE        (64 * 1024)
+#define MAX_RATE        (1024 * 1024 * 1024)
+#define PACER_DEPTH_USEC 2000   /* how far ahead of the rate we may burst */
+#define LOSS_THRESHOLD  20      /* permille loss we put down to noise */
+#define DELAY_SLACK     5       /* ms of extra delay before we stop probing */
+#define GROUP_FEEDBACK_INTERVAL 10 /* ms at least between changes to the
+                                      group's rate */
+#define CAROUSEL_CONTROL_EVERY 64 /* packets between each file info or run of
+                                     digests the carousel sends */
+#define CAROUSEL_INFO_EVERY 8   /* of those, how often it is the file info */
+#define CAROUSEL_RUN(blocks) ((blocks) + (blocks) / 4) /* packets of a section
+                                                          each time round */
+#define IN_FLIGHT_SLACK 10      /* ms past the group's delay that a packet may
+                                   still be on its way to a member */
+#define DRR_QUANTUM     DEFAULT_MTU /* bytes each client with work gets to send
+                                       in every round */
+#define SEND_BUDGET_USEC PACER_DEPTH_USEC /* longest we send for before
+                                             looking for requests again */
+#define MAX_SECTION_BURST(blocks) (8 * (blocks)) /* packets of a section a
+                                                    client may have queued */
+#define MAX_OUTSTANDING(blocks) (64 * MAX_SECTION_BURST(blocks)) /* and of
+                                                    all sections together */
+#define UNVERIFIED_RATE (2 * 1024 * 1024) /* bytes per second shared by every
+                                             client yet to echo its cookie */
+#define DEFAULT_CACHE_MB 64     /* of encoded symbols shared by every client */
+#define SPEC_SECTIONS   16      /* most sections past a client's request that
+                                   we encode ahead of its next one */
+#define SPEC_RUN(blocks) ((blocks) + (blocks) / 4) /* packets of each of them */
+#define SPEC_STEP       8       /* packets encoded ahead for each client before
+                                   looking for requests again */
+#define SESSION_TIMEOUT_USEC (30 * 1000000ULL) /* a quiet session after this
+                                                  may make way for a new one */
+
+#define SEND_BATCH      64   /* stored packets handed to the kernel at once */
+#define RING_FULL_USEC  200  /* to wait for a client to make room in its ring */
+
+#define ZEROCOPY_MIN_BLOCK  4096 /* smaller payloads are cheaper to copy */
+#define ZEROCOPY_SLOTS      256  /* zerocopy sends in flight at once */
+#define ZEROCOPY_MAX_COPIED 16   /* sends the kernel copied anyway before we
+                                    stop asking, e.g. on loopback */
 
 // ------ types ------
+
+/*
+ * Token bucket limiting how fast we send to a single client. The rate is
+ * adapted from the loss and delay that the client reports in its WAITs.
+ */
+typedef struct pacer_s {
+    double rate;        /* bytes per second */
+    double tokens;      /* bytes we may send right now */
+    uint64_t last;      /* usec timestamp of the last refill */
+    int min_delay;      /* lowest delay the client has reported, ms */
+} pacer_s;
+
+typedef struct spec_run_s {
+    int section;
+    uint32_t next;  /* id of the next symbol to encode */
+    uint32_t end;
+} spec_run_s;
+
 typedef struct client_s {
     struct sockaddr_in address;
+    uint64_t last_seen;
+    pacer_s pacer;
+    ftn_wire_s wire; /* packet layout and checksum agreed with the client */
+    int blk_size;   /* ours, or smaller to fit the client's path MTU */
+    int section_size; /* in blocks, so that sections are the same bytes */
+    int multicast;  /* gets its packets from the group */
+    uint32_t cookie; /* it echoes to show that it is at address */
+    int verified;   /* and has done so */
+    int deficit;    /* bytes it may still send this round */
+    uint32_t* next_id; /* symbols sent of each section, so the id of the next */
+    bset done;      /* sections the client has told us it has decoded */
+    int done_below; /* every section before this is done */
+    int num_done;
+    int started;    /* packets queued along with its file info */
+    int num_bursts; /* sections still to be sent, in the order requested */
+    struct { int section; int remaining; } bursts[MAX_WAIT_SECTIONS];
+    int num_spec;   /* runs of symbols we expect to send it, to encode ahead
+                       of time */
+    int spec_at;    /* the run we have got to */
+    spec_run_s spec[MAX_WAIT_SECTIONS + SPEC_SECTIONS];
+    const struct transport_s* transport; /* how its packets get to it */
+    shmring_s* ring; /* shared memory its packets go in, see shm_transport */
 } client_s;
 
+/*
+ * How packets reach a client: sent from our socket, or put in a ring of
+ * shared memory it handed us. Its file info, digests and requests always go
+ * over UDP.
+ */
+typedef struct transport_s {
+    /* whether a packet may go now, if not lowers wait_usec to when it may */
+    int (*allows)(client_s* client, uint64_t now, int64_t* wait_usec);
+    int (*send)(client_s* client, fountain_s* ftn, int from_mapping);
+    /* a packet already packed for the client, as the store has them */
+    int (*send_packed)(client_s* client, const char* packet, int length);
+    /* go back to UDP, letting go of whatever the client handed us */
+    void (*close)(client_s* client);
+} transport_s;
+
 
 // ------ Forward declarations ------
 static int create_connection(const char* ip_address);
-static int receive_request(client_s * new_client, const char * filename, const char* mapping, size_t len);
+static int receive_request(const char * filename);
 static void close_connection();
-static int send_fountain(client_s * client, fountain_s* ftn);
-static int send_block_burst(client_s * client, const char * mapping, size_t len, wait_signal_s* signal);
+static int udp_allows(client_s* client, uint64_t now, int64_t* wait_usec);
+static int udp_send(client_s * client, fountain_s* ftn, int from_mapping);
+static int udp_send_packed(client_s * client, const char* packet, int length);
+static void udp_close(client_s * client);
+#ifdef HAVE_SHMRING
+static int shm_allows(client_s* client, uint64_t now, int64_t* wait_usec);
+static int shm_send(client_s * client, fountain_s* ftn, int from_mapping);
+static int shm_send_packed(client_s * client, const char* packet, int length);
+static void shm_close(client_s * client);
+#endif
+static int send_batch();
+static int cache_serves(client_s* sender);
+static void queue_block_burst(client_s * client, wait_signal_s* signal,
+                              int length);
+static void client_note_done(client_s * client, done_signal_s* signal,
+                             int length);
+static int64_t speculate(const char * mapping, size_t len, int64_t wait_usec);
+static int64_t send_paced_bursts(const char * filename, const char * mapping,
+                                 size_t len);
+static int group_setup();
+static int group_reaches(client_s* member, int ifindex);
+static int recv_request(char* buf, struct sockaddr_in* from, int* ifindex);
+static int ring_socket_setup();
+static void receive_ring();
+static uint32_t new_nonce();
+static void cookie_key_init();
+static void pacer_init(pacer_s* pacer);
 static int send_info(client_s * client, const char * filename);
+static int start_packets(client_s * client, int start, int overhead,
+                         int request_length);
+static int start_bursts(client_s * client, int overhead);
+static int send_digests(client_s * client, digest_request_s* request, int length);
+static int send_digest_chunk(client_s * client, int first, int count);
+static int digest_sections(const char * mapping, size_t len);
 static int filesize_in_bytes(const char * filename);
+static int mtu_block_size(int mtu);
+#ifdef HAVE_ZEROCOPY
+static void zerocopy_reap();
+#endif
 
 
 
 // TODO: test use of long options on windows
 struct option long_options[] = {
     { "blocksize",  required_argument, NULL, 'b' },
+    { "cache",      required_argument, NULL, 'c' },
+    { "carousel",   required_argument, NULL, 'C' },
+    { "group",      required_argument, NULL, 'g' },
     { "help",       no_argument,       NULL, 'h' },
     { "ip",         required_argument, NULL, 'i' },
     { "latency",    required_argument, NULL, 'L' },
+    { "mtu",        required_argument, NULL, 'm' },
     { "port",       required_argument, NULL, 'p' },
+    { "rate",       required_argument, NULL, 'r' },
     { "sectionsize",required_argument, NULL, 's' },
+    { "store",      required_argument, NULL, 'S' },
+    { "unix",       required_argument, NULL, 'U' },
     { 0, 0, 0, 0 }
 };
 
@@ -63,11 +236,121 @@ static WSADATA w;
 static int listen_port = LISTEN_PORT;
 static char* listen_ip = LISTEN_IP;
 static char const * program_name;
-static int blk_size = -1; /* better to set this based on filesize */
-static int section_size = 20;
+static int blk_size = -1; /* -1 to fit the MTU */
+static int auto_blk_size = 0;
+static int section_size = 0; /* 0 to grow with the file */
+static int mtu = DEFAULT_MTU;
+
+/*
+ * In multicast mode one stream to the group serves every client that can
+ * join it. The group is sent to just like a client, with its own nonce,
+ * symbol ids and pacer, and sends whatever its members still ask for.
+ */
+static char* group_ip = NULL;
+static int group_port = 0;
+static int group_enabled = 0;
+static client_s group;
+/* when the group last sent each section, and the run of packets it is in */
+static struct group_section_s {
+    uint64_t sent_at;
+    uint64_t run_at;
+    uint32_t run_id;
+} * group_sections = NULL;
+static int group_next = 0; /* member whose request goes next */
+static int group_ifindex = 0; /* interface it goes out of, 0 for the route's */
+/* the worst its members have reported since the group's rate last changed */
+static struct {
+    int loss;
+    int delay;
+    uint64_t since;
+} group_feedback;
+static double fixed_rate = 0; /* bytes per second, 0 to adapt per client */
+
+/*
+ * In carousel mode the group streams a run of fresh symbols of each section
+ * in turn at a fixed rate, whether or not anyone is listening, with the file
+ * info and digests every so often among them. Its members ask for nothing.
+ */
+static double carousel_rate = 0; /* bytes per second, 0 if not a carousel */
+static int carousel_section = -1;
+static int carousel_left = 0;   /* packets of the section's run still to send */
+static int carousel_sent = 0;   /* packets, to space out the rest */
+static int carousel_controls = 0; /* file infos and runs of digests sent */
+static int carousel_chunk = 0;  /* the next run of digests to send */
+
+static client_s clients[MAX_CLIENTS];
+static int num_clients = 0;
 
 static int dbg_add_response_latency = 0;
 
+// SHA-256 of each section, worked out once up front, and the Merkle root over
+// them that we advertise in the file info
+static int num_sections = 0;
+static uint8_t* section_digests = NULL;
+static uint8_t merkle[SHA256_SIZE];
+
+// Unicast clients are all sent one stream of symbols, each from the start of
+// every section, so that what one is sent the next can be sent from the
+// cache. The group has a stream of its own, each picked out by a nonce.
+static uint64_t nonce_state;
+static uint32_t stream_nonce;
+static int cache_mb = DEFAULT_CACHE_MB;
+static symcache_s* cache = NULL;
+// Packets the fountain tool encoded ahead of time, the first of every section
+// in the unicast stream, which then takes the store's nonce
+static char* store_filename = NULL;
+static store_s* store = NULL;
+static uint64_t store_sent = 0;
+// Clients on this host may hand us rings of shared memory for their packets
+// over a unix socket at ring_path, which bypass the network altogether
+static char* ring_path = NULL;
+static SOCKET us = INVALID_SOCKET;
+static uint64_t ring_sent = 0;
+static const transport_s udp_transport = {
+    .allows = udp_allows,
+    .send = udp_send,
+    .send_packed = udp_send_packed,
+    .close = udp_close
+};
+#ifdef HAVE_SHMRING
+static const transport_s shm_transport = {
+    .allows = shm_allows,
+    .send = shm_send,
+    .send_packed = shm_send_packed,
+    .close = shm_close
+};
+#endif
+#ifdef HAVE_SENDMMSG
+// Stored packets waiting to go out together with one sendmmsg
+static struct {
+    int count;
+    struct mmsghdr msgs[SEND_BATCH];
+    struct iovec iov[SEND_BATCH];
+} batch;
+#endif
+// Cookies are a keyed hash of the client's address, which the key keeps
+// anyone else from working out
+static uint8_t cookie_key[SHA256_SIZE];
+// Everything sent to clients that have not echoed their cookie, as their
+// addresses could be forged to turn us on someone else
+static pacer_s unverified;
+
+#ifdef HAVE_ZEROCOPY
+/*
+ * Packets of a single block are sent with MSG_ZEROCOPY straight out of the
+ * file mapping. The kernel numbers these sends and tells us on the socket's
+ * error queue once it is done with their pages, until then the header that
+ * went with each has to stay put, so it lives in a slot here.
+ */
+static struct {
+    int enabled;
+    uint32_t next;      /* number the kernel will give the next send */
+    int num_copied;
+    char in_flight[ZEROCOPY_SLOTS];
+    char headers[ZEROCOPY_SLOTS][MAX_PACKED_FTN_HEADER_SIZE];
+} zerocopy = { };
+#endif
+
 // ------ functions ------
 static void print_usage_and_exit(int status) {
     FILE* out = (status == 0) ? stdout : stderr;
@@ -76,13 +359,37 @@ static void print_usage_and_exit(int status) {
     fputs("\
 \n\
   -b, --blocksize=BYTES     manually set the blocksize in bytes\n\
+  -c, --cache=MB            keep up to this many MB of encoded packets for\n\
+                              other clients to be sent too, 64 by default,\n\
+                              0 to encode every packet afresh\n\
+  -C, --carousel=KBPS       stream every section in turn to the group at this\n\
+                              rate in kB/s, for clients that cannot ask for\n\
+                              anything, needs --group\n\
+  -g, --group=IPADDRESS[:PORT]\n\
+                            send to clients that can join it through this\n\
+                              multicast group, the port is one above ours\n\
+                              by default. It goes out of the interface of\n\
+                              --ip, or else the one its first member reached\n\
+                              us on, members on others are sent to alone.\n\
+                              A carousel needs --ip unless the route to the\n\
+                              group is the interface its listeners are on\n\
   -h, --help                display this help message\n\
   -i, --ip=IPADDRESS        set the ip address to listen on, the default is \n\
                               0.0.0.0\n\
   -L, --latency=LATENCY     debug setting: adds response latency to the server\n\
+  -m, --mtu=BYTES           the MTU blocks are sized to fit, 1500 by default,\n\
+                              smaller for clients on a smaller path\n\
   -p, --port=PORT           set the UDP port to listen on, default is 2534\n\
+  -r, --rate=KBPS           send to each client at a fixed rate in kB/s,\n\
+                              the default adapts to the client's feedback\n\
   -s, --sectionsize=BLOCKS  the number of sections of blocks the file is\n\
                               sub-divided into\n\
+  -S, --store=STORE         send the packets that the fountain tool encoded\n\
+                              from FILE into STORE with -S, and encode only\n\
+                              those that it does not have\n\
+  -U, --unix=PATH           take rings of shared memory over a unix socket\n\
+                              at PATH from clients on this host, and put\n\
+                              their packets in them rather than send them\n\
 ", out);
     exit(status);
 }
@@ -91,11 +398,27 @@ int main(int argc, char** argv) {
     /* deal with options */
     program_name = argv[0];
     int c;
-    while ( (c = getopt_long(argc, argv, "b:hi:L:p:s:", long_options, NULL)) != -1) {
+    while ( (c = getopt_long(argc, argv, "b:c:C:g:hi:L:m:p:r:s:S:U:", long_options, NULL)) != -1) {
         switch (c) {
             case 'b':
                 blk_size = atoi(optarg);
                 break;
+            case 'c':
+                cache_mb = atoi(optarg);
+                break;
+            case 'C':
+                carousel_rate = atof(optarg) * 1024;
+                break;
+            case 'g':
+                group_ip = optarg;
+                {
+                    char* colon = strchr(optarg, ':');
+                    if (colon) {
+                        *colon = '\0';
+                        group_port = atoi(colon + 1);
+                    }
+                }
+                break;
             case 'h':
                 print_usage_and_exit(0);
                 break;
@@ -105,12 +428,29 @@ int main(int argc, char** argv) {
             case 'L':
                 dbg_add_response_latency = atoi(optarg);
                 break;
+            case 'm':
+                mtu = atoi(optarg);
+                break;
             case 'p':
                 listen_port = atoi(optarg);
                 break;
+            case 'r':
+                fixed_rate = atof(optarg) * 1024;
+                break;
             case 's':
                 section_size = atoi(optarg);
                 break;
+            case 'S':
+                store_filename = optarg;
+                break;
+            case 'U':
+#ifdef HAVE_SHMRING
+                ring_path = optarg;
+#else
+                log_err("Shared memory rings are not supported here");
+                print_usage_and_exit(1);
+#endif
+                break;
             case '?':
                 print_usage_and_exit(1);
                 break;
@@ -126,9 +466,20 @@ int main(int argc, char** argv) {
     } else {
         print_usage_and_exit(1);
     }
+    if (carousel_rate > 0 && !group_ip) {
+        log_err("A carousel needs a group to send to");
+        print_usage_and_exit(1);
+    }
 
-    /* seed random number generation */
+    /* seed random number generation, for clients that take no nonce */
     srand(time(NULL));
+    /* and the nonces that tell client streams apart */
+    nonce_state = (uint64_t)time(NULL) << 32 ^ (uint64_t)getpid() << 16
+                  ^ monotonic_usec();
+    stream_nonce = new_nonce();
+    cookie_key_init();
+    pacer_init(&unverified);
+    unverified.rate = UNVERIFIED_RATE;
 
     // Check that the file exists
     FILE* f = fopen(filename, "rb");
@@ -136,24 +487,65 @@ int main(int argc, char** argv) {
     fclose(f);
 
     int filesize = filesize_in_bytes(filename);
-    if (blk_size <= 0) {
-        blk_size = 128; // Should probably start at 1024
-        if (filesize < 0)
+    if (filesize < 0)
+        return -1;
+    if (store_filename) {
+        // the store decides the sizes we do not
+        store = store_open(store_filename);
+        if (!store)
+            return -1;
+        if (store->filesize != filesize
+                || (blk_size > 0 && blk_size != store->blk_size)
+                || (section_size > 0 && section_size != store->section_size)) {
+            log_err("The store %s was not made from %s with these sizes",
+                    store_filename, filename);
             return -1;
-        while (filesize / blk_size > INT16_MAX) {
-            blk_size <<= 1;
         }
+        if (blk_size <= 0)
+            auto_blk_size = 1;
+        blk_size = store->blk_size;
+        section_size = store->section_size;
+        stream_nonce = store->wire.nonce;
+    }
+    if (blk_size <= 0) {
+        // A block that fits in a packet, IP fragments would make each lost
+        // fragment cost us the whole packet. Small files only get blocks as
+        // large as they need to fill a section, so that they go in a few
+        // small packets rather than one of every block padded out.
+        int64_t needed = ((int64_t)filesize + DEFAULT_SECTION_SIZE - 1)
+                         / DEFAULT_SECTION_SIZE;
+        needed = (needed + BLOCK_ALIGN - 1) / BLOCK_ALIGN * BLOCK_ALIGN;
+        if (needed < MIN_BLOCK_SIZE)
+            needed = MIN_BLOCK_SIZE;
+        blk_size = mtu_block_size(mtu);
+        if (needed < blk_size)
+            blk_size = needed;
+        auto_blk_size = 1;
         odebug("%d", blk_size);
-    } else if (filesize / blk_size > INT16_MAX) {
-        /*  The user provided a blk_size... better check they haven't done  *
-         *  a silly                                                         */
-        log_err("Block size is too small. Cannot divide file "
-                "into %d pieces or more", INT16_MAX);
-        return -1;
     } else if (blk_size > MAX_BLOCK_SIZE) {
         log_err("Maximum block size is %d", MAX_BLOCK_SIZE);
         return -1;
     }
+    if (section_size <= 0) {
+        // Large files get larger sections rather than larger blocks
+        int64_t per_section = ((int64_t)filesize + MAX_SECTIONS - 1) / MAX_SECTIONS;
+        section_size = (per_section + blk_size - 1) / blk_size;
+        if (section_size < DEFAULT_SECTION_SIZE)
+            section_size = DEFAULT_SECTION_SIZE;
+        if (section_size > MAX_SECTION_BLOCKS) {
+            log_err("File too large for blocks of %d bytes", blk_size);
+            return -1;
+        }
+        odebug("%d", section_size);
+    }
+    if (((int64_t)filesize + blk_size * section_size - 1)
+            / (blk_size * section_size) > MAX_SECTIONS) {
+        /*  The user provided the sizes... better check they haven't done  *
+         *  a silly                                                         */
+        log_err("Blocks and sections are too small. Cannot divide file "
+                "into %d sections or more", MAX_SECTIONS);
+        return -1;
+    }
 
     int error;
     if ((error = create_connection(listen_ip)) < 0) {
@@ -168,13 +560,81 @@ int main(int argc, char** argv) {
         log_err("Error mapping file: %s", filename);
         return -1;
     }
+    if ((error = digest_sections(mapping, filesize)) < 0
+            || (error = group_setup()) < 0
+            || (error = ring_socket_setup()) < 0) {
+        unmap_file(mapping);
+        close_connection();
+        return handle_error(error, NULL);
+    }
+    if (store && memcmp(store->merkle_root, merkle, sizeof merkle) != 0) {
+        log_err("The store %s was made from a different file", store_filename);
+        unmap_file(mapping);
+        close_connection();
+        return -1;
+    }
+    if (cache_mb > 0) {
+        cache = symcache_new((size_t)cache_mb * 1024 * 1024,
+                             sizeof(fountain_s) + blk_size);
+        if (!cache)
+            log_warn("No room for a cache of %d MB, encoding every packet",
+                     cache_mb);
+    }
 
-    client_s client;
-    int request_type;
-    while ((request_type = receive_request(&client, filename, mapping, filesize)) >= 0) {
-        //
+    struct pollfd pfds[2] = {
+        { .fd = s, .events = POLLIN, .revents = 0 },
+        { .fd = us, .events = POLLIN, .revents = 0 }
+    };
+    struct pollfd* pfd = pfds;
+    const int nfds = (us != INVALID_SOCKET) ? 2 : 1;
+    for (;;) {
+        // Send whatever the pacers allow and sleep until they allow more or
+        // another request comes in
+        int64_t wait_usec = send_paced_bursts(filename, mapping, filesize);
+        if (wait_usec != 0)
+            wait_usec = speculate(mapping, filesize, wait_usec);
+        int timeout = (wait_usec < 0) ? -1 : (int)((wait_usec + 999) / 1000);
+        int pollret = poll(pfds, nfds, timeout);
+        if (pollret < 0) {
+            log_err("Error when waiting for requests");
+            break;
+        }
+        if (pfds[1].revents)
+            receive_ring();
+#ifdef HAVE_ZEROCOPY
+        if (pollret > 0 && (pfd->revents & POLLERR)) {
+            zerocopy_reap();
+            if (!(pfd->revents & ~POLLERR))
+                continue;
+        }
+#endif
+        if (pfd->revents && receive_request(filename) < 0)
+            break;
     }
 
+    for (int i = 0; i < num_clients; i++) {
+        free(clients[i].next_id);
+        bset_free(clients[i].done);
+        clients[i].transport->close(clients + i);
+    }
+    if (ring_path) {
+        log_info("Put %" PRIu64 " packets in shared memory rings", ring_sent);
+        unlink(ring_path);
+    }
+    if (cache) {
+        uint64_t hits, misses;
+        symcache_stats(cache, &hits, &misses);
+        log_info("Sent %" PRIu64 " packets from the cache, %" PRIu64 " were not in it",
+                 hits, misses);
+        symcache_free(cache);
+    }
+    if (store) {
+        log_info("Sent %" PRIu64 " packets from the store", store_sent);
+        store_close(store);
+    }
+    free(group.next_id);
+    free(group_sections);
+    free(section_digests);
     unmap_file(mapping);
     close_connection();
     return 0;
@@ -202,9 +662,50 @@ int create_connection(const char* ip_address) {
     if (bind(s, (struct sockaddr*)&addr, sizeof addr) < 0)
         return -40;
 
+#ifdef HAVE_ZEROCOPY
+    int one = 1;
+    if (blk_size >= ZEROCOPY_MIN_BLOCK
+            && setsockopt(s, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof one) == 0) {
+        debug("Sending single block packets with MSG_ZEROCOPY");
+        zerocopy.enabled = 1;
+    }
+#endif
     return 0;
 }
 
+#ifdef HAVE_ZEROCOPY
+/* Free the header slots of every zerocopy send the kernel has finished with */
+static void zerocopy_reap() {
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err))];
+    struct msghdr msg = {
+        .msg_control = control,
+        .msg_controllen = sizeof control
+    };
+    while (recvmsg(s, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) >= 0) {
+        struct cmsghdr* cm = CMSG_FIRSTHDR(&msg);
+        if (!cm || cm->cmsg_level != SOL_IP || cm->cmsg_type != IP_RECVERR)
+            goto next;
+        struct sock_extended_err* err = (void*)CMSG_DATA(cm);
+        if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+            goto next;
+
+        // completions come as a range of send numbers
+        for (uint32_t i = err->ee_info; ; i++) {
+            zerocopy.in_flight[i % ZEROCOPY_SLOTS] = 0;
+            if (i == err->ee_data)
+                break;
+        }
+        if ((err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                && ++zerocopy.num_copied == ZEROCOPY_MAX_COPIED) {
+            log_info("The kernel is copying zerocopy sends, turning it off");
+            zerocopy.enabled = 0;
+        }
+next:
+        msg.msg_controllen = sizeof control;
+    }
+}
+#endif
+
 void close_connection() {
     if (s)
         closesocket(s);
@@ -214,9 +715,447 @@ void close_connection() {
 }
 
 
+static void pacer_init(pacer_s* pacer) {
+    *pacer = (pacer_s) {
+        .rate = fixed_rate ? fixed_rate : INITIAL_RATE,
+        .last = monotonic_usec()
+    };
+}
+
+static void pacer_refill(pacer_s* pacer, uint64_t now) {
+    // Always allow a couple of packets through, however slow the rate
+    double depth = pacer->rate * PACER_DEPTH_USEC / 1e6;
+    const int packet_bytes = MAX_PACKED_FTN_HEADER_SIZE + blk_size
+                             + UDP_OVERHEAD;
+    if (depth < 2 * packet_bytes)
+        depth = 2 * packet_bytes;
+    pacer->tokens += pacer->rate * (now - pacer->last) / 1e6;
+    if (pacer->tokens > depth)
+        pacer->tokens = depth;
+    pacer->last = now;
+}
+
+/* returns the number of usec until bytes can be sent, 0 if they can now */
+static int64_t pacer_wait_usec(pacer_s* pacer, int bytes) {
+    if (pacer->tokens >= bytes)
+        return 0;
+    return (int64_t)((bytes - pacer->tokens) * 1e6 / pacer->rate) + 1;
+}
+
+/*
+ * Multiplicative decrease when the client lost packets, hold the rate while
+ * queues are building up (delay grows) and probe upwards otherwise
+ */
+static void pacer_feedback(pacer_s* pacer, int loss, int delay) {
+    if (fixed_rate)
+        return;
+    if (delay > 0 && (!pacer->min_delay || delay < pacer->min_delay))
+        pacer->min_delay = delay;
+
+    if (loss > LOSS_THRESHOLD) {
+        pacer->rate *= 1.0 - (loss > 500 ? 500 : loss) / 1000.0;
+    } else if (delay > 2 * pacer->min_delay + DELAY_SLACK) {
+        debug("Delay is growing (%d ms), holding rate", delay);
+    } else {
+        pacer->rate *= 1.25;
+    }
+    if (pacer->rate < MIN_RATE) pacer->rate = MIN_RATE;
+    if (pacer->rate > MAX_RATE) pacer->rate = MAX_RATE;
+    debug("loss = %d, delay = %d, rate now %.0lf B/s", loss, delay, pacer->rate);
+}
+
+/*
+ * Every member reports on the same packets, so rather than move the group's
+ * rate once for each of them, go by the worst report once per interval
+ */
+static void group_pacer_feedback(int loss, int delay) {
+    pacer_s* pacer = &group.pacer;
+    if (delay > 0 && (!pacer->min_delay || delay < pacer->min_delay))
+        pacer->min_delay = delay;
+    if (loss > group_feedback.loss)
+        group_feedback.loss = loss;
+    if (delay > group_feedback.delay)
+        group_feedback.delay = delay;
+
+    uint64_t now = monotonic_usec();
+    int interval = (pacer->min_delay > GROUP_FEEDBACK_INTERVAL)
+                   ? pacer->min_delay : GROUP_FEEDBACK_INTERVAL;
+    if (now - group_feedback.since < interval * 1000ULL)
+        return;
+    pacer_feedback(pacer, group_feedback.loss, group_feedback.delay);
+    group_feedback.loss = group_feedback.delay = 0;
+    group_feedback.since = now;
+}
+
+/* The largest block that fits in a packet on a path of the given MTU */
+static int mtu_block_size(int mtu) {
+    int size = mtu - UDP_OVERHEAD - MAX_PACKED_FTN_HEADER_SIZE;
+    size -= size % BLOCK_ALIGN;
+    return (size < MIN_BLOCK_SIZE) ? MIN_BLOCK_SIZE
+         : (size > MAX_BLOCK_SIZE) ? MAX_BLOCK_SIZE : size;
+}
+
+/*
+ * Halve our blocks, and double the blocks per section so that sections stay
+ * the same, until they fit the smaller of the path MTU the client saw and the
+ * one we see to the client. Blocks chosen by hand are left alone.
+ */
+static void client_fit_blocks(client_s* client, int client_mtu) {
+    client->blk_size = blk_size;
+    client->section_size = section_size;
+    if (!auto_blk_size)
+        return;
+
+    int fit = path_mtu(&client->address);
+    if (client_mtu > 0 && (fit == 0 || client_mtu < fit))
+        fit = client_mtu;
+    if (fit == 0)
+        return;
+    while (client->blk_size + MAX_PACKED_FTN_HEADER_SIZE + UDP_OVERHEAD > fit
+            && client->blk_size % 2 == 0
+            && client->blk_size / 2 >= MIN_BLOCK_SIZE
+            && client->section_size * 2 <= MAX_SECTION_BLOCKS) {
+        client->blk_size /= 2;
+        client->section_size *= 2;
+    }
+    if (client->blk_size != blk_size)
+        log_info("Blocks of %d bytes to fit a path MTU of %d",
+                 client->blk_size, fit);
+}
+
+/* splitmix64, so that consecutive nonces look nothing alike, never 0 */
+static uint32_t new_nonce() {
+    uint32_t nonce;
+    do {
+        uint64_t z = (nonce_state += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        nonce = (z ^ (z >> 31)) >> 32;
+    } while (!nonce);
+    return nonce;
+}
+
+/* Fill the cookie key from the system's randomness, or our nonces without */
+static void cookie_key_init() {
+    FILE* f = fopen("/dev/urandom", "rb");
+    size_t got = f ? fread(cookie_key, 1, sizeof cookie_key, f) : 0;
+    if (f) fclose(f);
+    if (got == sizeof cookie_key)
+        return;
+    log_warn("No /dev/urandom, cookies are only as good as the clock");
+    for (int i = 0; i < sizeof cookie_key; i += sizeof(uint32_t)) {
+        uint32_t word = new_nonce();
+        memcpy(cookie_key + i, &word, sizeof word);
+    }
+}
+
+/* The cookie of the session starting at address, never 0 */
+static uint32_t new_cookie(struct sockaddr_in* address, uint32_t salt) {
+    uint8_t digest[SHA256_SIZE];
+    sha256_s ctx;
+    sha256_init(&ctx);
+    sha256_update(&ctx, cookie_key, sizeof cookie_key);
+    sha256_update(&ctx, &address->sin_addr, sizeof address->sin_addr);
+    sha256_update(&ctx, &address->sin_port, sizeof address->sin_port);
+    sha256_update(&ctx, &salt, sizeof salt);
+    sha256_final(&ctx, digest);
+    uint32_t cookie;
+    memcpy(&cookie, digest, sizeof cookie);
+    return cookie ? cookie : 1;
+}
+
+/*
+ * The token of an address, which only a client there can have been sent. It
+ * does not depend on the port, so that a later download from the same host
+ * can show it too.
+ */
+static uint32_t address_token(struct sockaddr_in* address) {
+    struct sockaddr_in host = {
+        .sin_family = AF_INET,
+        .sin_addr = address->sin_addr
+    };
+    return new_cookie(&host, MAGIC_INFO);
+}
+
+/*
+ * Point multicast sends at the group out of the interface we listen on. On
+ * every interface the group follows its members instead, so we need to know
+ * which one each request comes in on.
+ * returns 0 or an error code
+ */
+static int group_setup() {
+    if (!group_ip)
+        return 0;
+    group.address = (struct sockaddr_in) {
+        .sin_family = AF_INET,
+        .sin_port = htons(group_port ? group_port : listen_port + 1),
+        .sin_addr.s_addr = inet_addr(group_ip)
+    };
+    if (!IN_MULTICAST(ntohl(group.address.sin_addr.s_addr))) {
+        log_err("%s is not a multicast address", group_ip);
+        return ERR_INVALID;
+    }
+
+    // 0.0.0.0 leaves the kernel to pick by the route to the group
+    struct in_addr iface = { .s_addr = inet_addr(listen_ip) };
+    int loop = 1;
+    if (setsockopt(s, IPPROTO_IP, IP_MULTICAST_IF, (char*)&iface,
+                   sizeof iface) < 0
+            || setsockopt(s, IPPROTO_IP, IP_MULTICAST_LOOP, (char*)&loop,
+                          sizeof loop) < 0) {
+        log_err("Unable to send to multicast groups");
+        return ERR_NETWORK;
+    }
+#ifdef HAVE_PKTINFO
+    if (iface.s_addr == htonl(INADDR_ANY) && carousel_rate == 0
+            && setsockopt(s, IPPROTO_IP, IP_PKTINFO, (char*)&loop,
+                          sizeof loop) < 0)
+        log_warn("Unable to tell which interface members are on");
+#endif
+
+    // Members must all be able to read the same packets
+    group.wire = (ftn_wire_s) {
+        .version = FTN_WIRE_V2,
+        .checksum = FTN_CHECKSUM_CRC32C,
+        .nonce = new_nonce()
+    };
+    group.blk_size = blk_size;
+    group.section_size = section_size;
+    group.next_id = calloc(num_sections, sizeof *group.next_id);
+    group_sections = calloc(num_sections, sizeof *group_sections);
+    if (!group.next_id || !group_sections)
+        return ERR_MEM;
+    pacer_init(&group.pacer);
+    if (carousel_rate > 0)
+        group.pacer.rate = carousel_rate;
+    group.transport = &udp_transport;
+    group.multicast = 1; // so that the file info it sends names the group
+    group.verified = 1;  // only members can ask for anything to be sent
+    group_enabled = 1;
+    printf("Sending to group %s:%d%s\n", group_ip, ntohs(group.address.sin_port),
+           (carousel_rate > 0) ? " as a carousel" : "");
+    return 0;
+}
+
+/*
+ * Whether the group goes out of the interface a member's requests reach us
+ * on, ifindex, so that it can hear it. Only while no other member is part
+ * way through may the group move over to a new member's interface.
+ */
+static int group_reaches(client_s* member, int ifindex) {
+#ifdef HAVE_PKTINFO
+    if (ifindex == 0 || ifindex == group_ifindex)
+        return 1;
+    const uint64_t now = monotonic_usec();
+    for (int i = 0; i < num_clients; i++) {
+        client_s* client = clients + i;
+        if (client != member && client->multicast && client->last_seen
+                && now - client->last_seen < SESSION_TIMEOUT_USEC)
+            return 0;
+    }
+    struct ip_mreqn iface = { .imr_ifindex = ifindex };
+    if (setsockopt(s, IPPROTO_IP, IP_MULTICAST_IF, (char*)&iface,
+                   sizeof iface) < 0) {
+        log_warn("Unable to send to the group on interface %d", ifindex);
+        return 0;
+    }
+    debug("Sending to the group on interface %d", ifindex);
+    group_ifindex = ifindex;
+#endif
+    return 1;
+}
+
+/*
+ * Whether a new session may take over the client's record, which we allow
+ * for those that never showed they are at their address and those that
+ * have finished or gone quiet
+ */
+static int session_may_end(client_s* client, uint64_t now) {
+    return !client->verified || now - client->last_seen > SESSION_TIMEOUT_USEC;
+}
+
+/*
+ * Find the session of the client at address. Asking for the file info starts
+ * a new one, in the stalest record that may end if we have no room left, as
+ * that is how every download begins. A session part way through is kept as
+ * is, a forged request must not be able to end it.
+ * returns NULL if there is no session for it
+ */
+static client_s* client_lookup(struct sockaddr_in* address, int start) {
+    const uint64_t now = monotonic_usec();
+    client_s* client = NULL;
+    client_s* stalest = NULL;
+    for (int i = 0; i < num_clients && !client; i++) {
+        if (clients[i].address.sin_addr.s_addr == address->sin_addr.s_addr
+                && clients[i].address.sin_port == address->sin_port)
+            client = clients + i;
+        else if (session_may_end(clients + i, now)
+                 && (!stalest || clients[i].last_seen < stalest->last_seen))
+            stalest = clients + i;
+    }
+    if (client && (!start || !session_may_end(client, now))) {
+        if (start) {
+            // It may have started over, so let it have every section again
+            memset(client->done, 0, bset_len(num_sections) * sizeof *client->done);
+            client->num_done = client->done_below = 0;
+            // and hand us a new ring
+            client->transport->close(client);
+        }
+        if (client->num_done < num_sections)
+            client->last_seen = now;
+        return client;
+    }
+    if (!start)
+        return NULL;
+    if (!client)
+        client = (num_clients < MAX_CLIENTS) ? clients + num_clients++ : stalest;
+    if (!client)
+        return NULL;
+
+    uint32_t* next_id = client->next_id;
+    bset done = client->done;
+    if (client->transport)
+        client->transport->close(client);
+    memset(client, 0, sizeof *client);
+    client->transport = &udp_transport;
+    client->address = *address;
+    client->last_seen = now;
+    client->wire.nonce = stream_nonce;
+    client->cookie = new_cookie(address, new_nonce());
+    client->blk_size = blk_size;
+    client->section_size = section_size;
+    // A fresh nonce makes a fresh stream, so every section starts over at 0
+    client->next_id = next_id ? memset(next_id, 0, num_sections * sizeof *next_id)
+                              : calloc(num_sections, sizeof *next_id);
+    client->done = done ? memset(done, 0, bset_len(num_sections) * sizeof *done)
+                        : bset_alloc(num_sections);
+    pacer_init(&client->pacer);
+    return client;
+}
+
+/*
+ * Mark the client verified if the cookie at offset in its message is the
+ * one we gave it
+ */
+static void client_check_cookie(client_s* client, const char* msg, int length,
+                                size_t offset) {
+    uint32_t cookie;
+    if (client->verified || length < offset + sizeof cookie)
+        return;
+    memcpy(&cookie, msg + offset, sizeof cookie);
+    if (ntohl(cookie) == client->cookie) {
+        debug("%s:%d echoed its cookie", inet_ntoa(client->address.sin_addr),
+              ntohs(client->address.sin_port));
+        client->verified = 1;
+    }
+}
+
+/*
+ * Whether we may send bytes of anything but packets to the client now. What
+ * goes to unverified clients comes out of a budget they all share.
+ */
+static int client_may_reply(client_s* client, int bytes) {
+    if (client->verified)
+        return 1;
+    pacer_refill(&unverified, monotonic_usec());
+    if (unverified.tokens < bytes) {
+        debug("Over the budget for unverified clients, not replying");
+        return 0;
+    }
+    unverified.tokens -= bytes;
+    return 1;
+}
+
+/*
+ * Listen on a unix socket for clients on this host to hand us rings of shared
+ * memory to put their packets in
+ * returns 0 or an error code
+ */
+int ring_socket_setup() {
+    if (!ring_path)
+        return 0;
+#ifdef HAVE_SHMRING
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if (strlen(ring_path) >= sizeof address.sun_path) {
+        log_err("The path %s is too long for a unix socket", ring_path);
+        return ERR_INVALID;
+    }
+    strcpy(address.sun_path, ring_path);
+    unlink(ring_path); // left behind by an earlier run
+    us = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (us == INVALID_SOCKET
+            || bind(us, (struct sockaddr*)&address, sizeof address) < 0) {
+        log_err("Unable to listen for rings on %s", ring_path);
+        return ERR_NETWORK;
+    }
+    printf("Taking rings on %s ...\n", ring_path);
+#endif
+    return 0;
+}
+
+/*
+ * Take the ring a client on this host hands us along with its eventfd, once
+ * its cookie shows that it is the client at the address it says
+ */
+void receive_ring() {
+#ifdef HAVE_SHMRING
+    ring_request_s request;
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    struct iovec iov = { .iov_base = &request, .iov_len = sizeof request };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof control
+    };
+    int length = recvmsg(us, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+    if (length < 0)
+        return;
+    // any more descriptors than fit the kernel has closed for us
+    int fds[2] = { -1, -1 };
+    int num_fds = 0;
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+            cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            num_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), num_fds * sizeof(int));
+        }
+    }
+
+    client_s* client = NULL;
+    if (length == sizeof request && num_fds == 2
+            && ntohl(request.magic) == MAGIC_RING) {
+        struct sockaddr_in address = {
+            .sin_family = AF_INET,
+            .sin_port = request.port,
+            .sin_addr.s_addr = request.address
+        };
+        client = client_lookup(&address, 0);
+        if (client && (client->multicast
+                       || ntohl(request.cookie) != client->cookie))
+            client = NULL;
+    }
+    if (!client) {
+        log_warn("Ring from no client of ours");
+        for (int i = 0; i < num_fds; i++)
+            close(fds[i]);
+        return;
+    }
+    client->transport->close(client);
+    client->ring = shmring_attach(fds[0], fds[1]);
+    if (client->ring)
+        client->transport = &shm_transport;
+    client->verified = 1;
+    debug("%s:%d handed us its ring", inet_ntoa(client->address.sin_addr),
+          ntohs(client->address.sin_port));
+#endif
+}
+
 static void wait_signal_order_from_network(wait_signal_s* wait_signal) {
     fp_from(wait_signal->magic);
     fp_from(wait_signal->num_sections);
+    fp_from(wait_signal->loss);
+    fp_from(wait_signal->delay);
 
     int n = wait_signal->num_sections;
     for (int i = 0; i < n; i++) {
@@ -224,20 +1163,77 @@ static void wait_signal_order_from_network(wait_signal_s* wait_signal) {
         fp_from(wait_signal->sections[i].capacity);
     }
 }
+/*
+ * Receive a message into buf, RECV_LEN bytes, and with IP_PKTINFO on find
+ * out the interface it came in on, otherwise ifindex is 0
+ * returns the length of the message or -1
+ */
+static int recv_request(char* buf, struct sockaddr_in* from, int* ifindex) {
+    *ifindex = 0;
+#ifdef HAVE_PKTINFO
+    char control[CMSG_SPACE(sizeof(struct in_pktinfo))];
+    struct iovec iov = { .iov_base = buf, .iov_len = RECV_LEN };
+    struct msghdr msg = {
+        .msg_name = from,
+        .msg_namelen = sizeof *from,
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof control
+    };
+    int length = recvmsg(s, &msg, 0);
+    if (length < 0)
+        return -1;
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+            cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO) {
+            struct in_pktinfo info;
+            memcpy(&info, CMSG_DATA(cmsg), sizeof info);
+            *ifindex = info.ipi_ifindex;
+        }
+    }
+    return length;
+#else
+    socklen_t from_size = sizeof *from;
+    return recvfrom(s, buf, RECV_LEN, 0, (struct sockaddr*)from, &from_size);
+#endif
+}
+
 //
-// Translate the message sent to us
+// Translate the message sent to us, dropping any we make no sense of
+// returns 0, or -1 if the socket failed
 
-int receive_request(client_s * new_client, const char * filename, const char* mapping, size_t len) {
-    char buf[BUF_LEN];
+int receive_request(const char * filename) {
+    char buf[RECV_LEN];
     struct sockaddr_in remote_addr;
-    socklen_t remote_addr_size = sizeof remote_addr;
+    int ifindex;
 
-    memset(buf, '\0', BUF_LEN);
-    if (recvfrom(s, buf, BUF_LEN, 0, (struct sockaddr*)&remote_addr,
-                &remote_addr_size) < 0)
+    memset(buf, '\0', RECV_LEN);
+    int bytes_recvd = recv_request(buf, &remote_addr, &ifindex);
+    if (bytes_recvd < 0)
         return -1;
+    if (bytes_recvd < sizeof(packet_s)) {
+        log_warn("Dropped a %d byte message from %s:%d", bytes_recvd,
+                 inet_ntoa(remote_addr.sin_addr), ntohs(remote_addr.sin_port));
+        return 0;
+    }
+
+    // Lookup the message in the table
+    packet_s* packet = (packet_s*)buf;
+    int magic = ntohl(packet->magic);
 
-    new_client->address = remote_addr;
+    client_s* client = client_lookup(&remote_addr, magic == MAGIC_REQUEST_INFO);
+    if (!client && magic == MAGIC_REQUEST_INFO) {
+        // Every session is busy, it will ask again
+        log_warn("No room for a session for %s:%d",
+                 inet_ntoa(remote_addr.sin_addr), ntohs(remote_addr.sin_port));
+        return 0;
+    } else if (!client) {
+        // We have let its session go, it will time out and start over
+        log_warn("No session for %s:%d", inet_ntoa(remote_addr.sin_addr),
+                 ntohs(remote_addr.sin_port));
+        return 0;
+    }
 
     debug("Received msg: %s", buf);
 
@@ -250,25 +1246,102 @@ int receive_request(client_s * new_client, const char * filename, const char* ma
     }
 #endif
 
-    // Lookup the message in the table
-    packet_s* packet = (packet_s*)buf;
-    int magic = ntohl(packet->magic);
-
-    int error;
+    int error = 0;
 
     switch (magic) {
         case MAGIC_REQUEST_INFO:
-            error = send_info(new_client, filename);
+            if (client->verified) {
+                // It is part way through, so whatever it asks it gets the
+                // same again
+                error = send_info(client, filename);
+            } else {
+                // Older clients send just the magic, the rest of buf is 0
+                info_request_s* request = (info_request_s*)buf;
+                int checksums = ntohs(request->checksums);
+                int versions = ntohs(request->versions);
+                client->wire.checksum = (checksums & (1 << FTN_CHECKSUM_CRC32C))
+                                        ? FTN_CHECKSUM_CRC32C
+                                        : FTN_CHECKSUM_FLETCHER16;
+                client->wire.version = (versions & (1 << FTN_WIRE_V2))
+                                       ? FTN_WIRE_V2 : FTN_WIRE_V1;
+                // v1 carries the whole seed so any client can take a nonce
+                if (client->wire.version == FTN_WIRE_V2
+                        && !(ntohs(request->flags) & REQUEST_FLAG_NONCE))
+                    client->wire.nonce = 0;
+                client_fit_blocks(client, ntohs(request->mtu));
+
+                int wanted = REQUEST_FLAG_NONCE | REQUEST_FLAG_MULTICAST
+                             | (carousel_rate > 0 ? REQUEST_FLAG_CAROUSEL : 0);
+                client->multicast = group_enabled
+                    && (ntohs(request->flags) & wanted) == wanted
+                    && (versions & (1 << group.wire.version))
+                    && (checksums & (1 << group.wire.checksum))
+                    && group_reaches(client, ifindex);
+                if (client->multicast) {
+                    client->wire = group.wire;
+                    client->blk_size = group.blk_size;
+                    client->section_size = group.section_size;
+                }
+                // It has been sent its token at this address before
+                if (bytes_recvd >= offsetof(info_request_s, token)
+                                   + sizeof request->token
+                        && ntohl(request->token)
+                           == address_token(&client->address)) {
+                    debug("%s:%d showed its token",
+                          inet_ntoa(client->address.sin_addr),
+                          ntohs(client->address.sin_port));
+                    client->verified = 1;
+                }
+                int overhead = ntohs(request->start_overhead);
+                if (overhead > START_MAX_OVERHEAD)
+                    overhead = START_MAX_OVERHEAD;
+                client->started = start_packets(client, ntohs(request->start),
+                                                overhead, bytes_recvd);
+                error = send_info(client, filename);
+                if (error > 0 && client->started)
+                    error = start_bursts(client, overhead);
+            }
+            break;
+        case MAGIC_REQUEST_DIGESTS:
+            client_check_cookie(client, buf, bytes_recvd,
+                                offsetof(digest_request_s, cookie));
+            error = send_digests(client, (digest_request_s*)buf, bytes_recvd);
             break;
         case MAGIC_WAITING:
             {
+                // Nothing a member asks for changes what a carousel sends
+                if (client->multicast && carousel_rate > 0)
+                    break;
                 wait_signal_s* signal = (wait_signal_s*)buf;
+                if (bytes_recvd < sizeof *signal
+                        || ntohs(signal->num_sections) > MAX_WAIT_SECTIONS
+                        || bytes_recvd < WAIT_SIGNAL_SIZE(ntohs(signal->num_sections))) {
+                    log_warn("Truncated wait signal");
+                    break;
+                }
+                int n = ntohs(signal->num_sections);
+                client_check_cookie(client, buf, bytes_recvd,
+                                    client->multicast ? WAIT_SIGNAL_SEEN_SIZE(n)
+                                                      : WAIT_SIGNAL_SIZE(n));
                 wait_signal_order_from_network(signal);
-                error = send_block_burst(new_client, mapping, len, signal);
+                // The group slows down for whichever member is worst off
+                if (client->multicast)
+                    group_pacer_feedback(signal->loss, signal->delay);
+                else
+                    pacer_feedback(&client->pacer, signal->loss,
+                                   signal->delay);
+                queue_block_burst(client, signal, bytes_recvd);
             }
             break;
+        case MAGIC_DONE:
+            client_note_done(client, (done_signal_s*)buf, bytes_recvd);
+            break;
         default:
-            return -1;
+            // Anyone can send us anything, it is no reason to stop
+            log_warn("Dropped a message from %s:%d with unknown magic %08x",
+                     inet_ntoa(remote_addr.sin_addr),
+                     ntohs(remote_addr.sin_port), magic);
+            break;
     }
 
     if (error < 0)
@@ -282,6 +1355,14 @@ static void file_info_order_for_network(file_info_s* info) {
     fp_to(info->section_size);
     fp_to(info->blk_size);
     fp_to(info->filesize);
+    fp_to(info->checksum);
+    fp_to(info->version);
+    fp_to(info->nonce);
+    fp_to(info->group_port);
+    fp_to(info->flags);
+    fp_to(info->cookie);
+    fp_to(info->start_packets);
+    fp_to(info->token);
 }
 
 int filesize_in_bytes(const char * filename) {
@@ -293,15 +1374,32 @@ int filesize_in_bytes(const char * filename) {
 }
 
 
+/*
+ * returns 1 once sent, 0 if it would be over the budget for unverified
+ * clients, or an error code
+ */
 int send_info(client_s * client, const char * filename) {
     debug("Sending info for file %s", filename);
 
     file_info_s info = {
         .magic          = MAGIC_INFO,
-        .section_size   = section_size,
-        .blk_size       = blk_size,
+        .section_size   = client->section_size,
+        .blk_size       = client->blk_size,
         .filesize       = filesize_in_bytes(filename),
+        .checksum       = client->wire.checksum,
+        .version        = client->wire.version,
+        .nonce          = client->wire.nonce,
+        .group          = client->multicast ? group.address.sin_addr.s_addr : 0,
+        .group_port     = client->multicast ? ntohs(group.address.sin_port) : 0,
+        .flags          = ((client->multicast && carousel_rate > 0)
+                           ? INFO_FLAG_CAROUSEL : INFO_FLAG_DONE)
+                          | (client->started ? INFO_FLAG_STARTED : 0),
+        .cookie         = client->cookie,
+        .start_packets  = client->started,
+        .token          = client->multicast ? 0
+                                            : address_token(&client->address),
     };
+    memcpy(info.merkle_root, merkle, sizeof info.merkle_root);
 
     strncpy(info.filename, filename, sizeof info.filename - 1);
 #ifdef _WIN32
@@ -315,6 +1413,8 @@ int send_info(client_s * client, const char * filename) {
     odebug("%"PRId16, info.blk_size);
     odebug("%"PRId32, info.filesize);
 
+    if (!client_may_reply(client, sizeof info + UDP_OVERHEAD))
+        return 0;
     file_info_order_for_network(&info);
 
     int bytes_sent = sendto(s, (char*)&info, sizeof info, 0,
@@ -322,39 +1422,835 @@ int send_info(client_s * client, const char * filename) {
             sizeof client->address);
 
     if (bytes_sent == SOCKET_ERROR) return ERR_SEND;
+    return 1;
+}
+
+/*
+ * How many packets of the first start sections to send along with the file
+ * info. Only once every digest fits in a message can the client check
+ * sections without asking us for them first. Unless it shows the token we
+ * gave its address anyone could have sent the request in its name, so with
+ * the file info and digests they must come to no more than
+ * START_AMPLIFICATION times the bytes of the request.
+ * returns the number of packets, 0 to start on none
+ */
+int start_packets(client_s * client, int start, int overhead,
+                  int request_length) {
+    if (client->multicast || num_sections > MAX_DIGESTS_PER_MSG)
+        return 0;
+    if (start > num_sections)
+        start = num_sections;
+    const int wanted = start * START_CAPACITY(client->section_size, overhead);
+    if (client->verified)
+        return wanted;
+    const int budget = START_AMPLIFICATION * request_length
+                       - sizeof(file_info_s) - DIGESTS_SIZE(num_sections);
+    const int packets = (budget > 0)
+        ? budget / PACKED_FTN_SIZE(client->wire, client->blk_size) : 0;
+    return (packets < wanted) ? packets : wanted;
+}
+
+/*
+ * Send the digests and queue the packets that the client asked us to start
+ * on in its info request, just as if it had sent a wait signal for them
+ * returns 0 or an error code
+ */
+int start_bursts(client_s * client, int overhead) {
+    int result = send_digest_chunk(client, 0, num_sections);
+    if (result < 0)
+        return result;
+
+    char buf[WAIT_SIGNAL_SIZE(MAX_WAIT_SECTIONS)];
+    wait_signal_s* signal = (wait_signal_s*)buf;
+    const int capacity = START_CAPACITY(client->section_size, overhead);
+    *signal = (wait_signal_s) { .magic = MAGIC_WAITING };
+    for (int left = client->started; left > 0
+            && signal->num_sections < MAX_WAIT_SECTIONS; ) {
+        int i = signal->num_sections++;
+        signal->sections[i].section = i;
+        signal->sections[i].capacity = (left < capacity) ? left : capacity;
+        left -= signal->sections[i].capacity;
+    }
+    debug("Starting on %d packets of %d sections with the file info",
+          client->started, signal->num_sections);
+    queue_block_burst(client, signal, WAIT_SIGNAL_SIZE(signal->num_sections));
     return 0;
 }
 
-int send_fountain(client_s * client, fountain_s* ftn) {
-    buffer_s packet = pack_fountain(ftn);
-    if (packet.length == 0) return ERR_PACKING;
+int send_digests(client_s * client, digest_request_s* request, int length) {
+    if (length < offsetof(digest_request_s, cookie)) {
+        log_warn("Truncated digest request");
+        return 0;
+    }
+    return send_digest_chunk(client, ntohs(request->first),
+                             ntohs(request->count));
+}
+
+/* Send the digests of up to count sections from first */
+int send_digest_chunk(client_s * client, int first, int count) {
+    if (count > MAX_DIGESTS_PER_MSG)
+        count = MAX_DIGESTS_PER_MSG;
+    if (first >= num_sections)
+        count = 0;
+    else if (first + count > num_sections)
+        count = num_sections - first;
+
+    char buf[DIGESTS_SIZE(MAX_DIGESTS_PER_MSG)];
+    digests_s* reply = (digests_s*)buf;
+    reply->magic = MAGIC_DIGESTS;
+    reply->first = first;
+    reply->count = count;
+    memcpy(reply->digests, section_digests + first * SHA256_SIZE,
+           count * SHA256_SIZE);
+    fp_to(reply->magic);
+    fp_to(reply->first);
+    fp_to(reply->count);
 
-    int bytes_sent = sendto(s, packet.buffer, packet.length, 0,
+    if (!client_may_reply(client, DIGESTS_SIZE(count) + UDP_OVERHEAD))
+        return 0;
+    int bytes_sent = sendto(s, buf, DIGESTS_SIZE(count), 0,
             (struct sockaddr*)&client->address,
             sizeof client->address);
 
-    free(packet.buffer);
+    if (bytes_sent == SOCKET_ERROR) return ERR_SEND;
+    return 0;
+}
+
+typedef struct digest_job_s {
+    const char* mapping;
+    size_t len;
+    int first;  /* this thread does first, first + step, ... */
+    int step;
+} digest_job_s;
+
+static void* digest_sections_main(void* arg) {
+    digest_job_s* job = arg;
+    size_t bytes_per_section = (size_t)blk_size * section_size;
+    for (int i = job->first; i < num_sections; i += job->step) {
+        size_t offset = i * bytes_per_section;
+        size_t length = job->len - offset < bytes_per_section
+                        ? job->len - offset : bytes_per_section;
+        section_digest(job->mapping + offset, length,
+                       section_digests + i * SHA256_SIZE);
+    }
+    return NULL;
+}
+
+/*
+ * Hash every section, spread over all the cores as this reads the whole file,
+ * and the Merkle root over them
+ * returns 0 or an error code
+ */
+int digest_sections(const char * mapping, size_t len) {
+    size_t bytes_per_section = (size_t)blk_size * section_size;
+    num_sections = (len + bytes_per_section - 1) / bytes_per_section;
+    section_digests = malloc(num_sections * SHA256_SIZE + 1);
+    if (!section_digests)
+        return ERR_MEM;
+
+    int num_threads = online_cpus();
+    if (num_threads > num_sections)
+        num_threads = num_sections;
+    if (num_threads < 1)
+        num_threads = 1;
+
+#ifndef NDEBUG
+    uint64_t start = monotonic_usec();
+#endif
+    pthread_t threads[num_threads];
+    digest_job_s jobs[num_threads];
+    int started[num_threads];
+    for (int t = 0; t < num_threads; t++) {
+        jobs[t] = (digest_job_s) {
+            .mapping = mapping,
+            .len = len,
+            .first = t,
+            .step = num_threads
+        };
+        started[t] = pthread_create(threads + t, NULL,
+                                    digest_sections_main, jobs + t) == 0;
+        if (!started[t]) // do it ourselves
+            digest_sections_main(jobs + t);
+    }
+    for (int t = 0; t < num_threads; t++) {
+        if (started[t])
+            pthread_join(threads[t], NULL);
+    }
+    debug("Hashed %d sections on %d threads in %"PRIu64" us", num_sections,
+          num_threads, monotonic_usec() - start);
+
+    return merkle_root(section_digests, num_sections, merkle);
+}
+
+/*
+ * Send the header from the stack and the payload from wherever the encoder
+ * left it, which for single block packets is the file mapping itself. Those
+ * we let the kernel send without copying where it can.
+ */
+int udp_send(client_s * client, fountain_s* ftn, int from_mapping) {
+    char stack_header[MAX_PACKED_FTN_HEADER_SIZE];
+    char* header = stack_header;
+    int flags = 0;
+#ifdef HAVE_ZEROCOPY
+    int slot = zerocopy.next % ZEROCOPY_SLOTS;
+    if (from_mapping && zerocopy.enabled) {
+        if (zerocopy.in_flight[slot])
+            zerocopy_reap();
+        if (!zerocopy.in_flight[slot]) {
+            header = zerocopy.headers[slot];
+            flags = MSG_ZEROCOPY;
+        }
+    }
+#endif
+    int header_size = pack_fountain_header(ftn, client->wire, header);
+
+#ifdef _WIN32
+    WSABUF bufs[2] = {
+        { .len = header_size, .buf = header },
+        { .len = ftn->blk_size, .buf = ftn->string }
+    };
+    DWORD bytes_sent;
+    int result = WSASendTo(s, bufs, 2, &bytes_sent, 0,
+            (struct sockaddr*)&client->address, sizeof client->address,
+            NULL, NULL);
+#else
+    struct iovec iov[2] = {
+        { .iov_base = header, .iov_len = header_size },
+        { .iov_base = ftn->string, .iov_len = ftn->blk_size }
+    };
+    struct msghdr msg = {
+        .msg_name = &client->address,
+        .msg_namelen = sizeof client->address,
+        .msg_iov = iov,
+        .msg_iovlen = 2
+    };
+    int result = sendmsg(s, &msg, flags);
+#endif
+#ifdef HAVE_ZEROCOPY
+    if (flags && result == SOCKET_ERROR && errno == ENOBUFS) {
+        // Out of memory to pin pages with, copy this one
+        flags = 0;
+        result = sendmsg(s, &msg, flags);
+    }
+    if (flags && result != SOCKET_ERROR) {
+        zerocopy.in_flight[slot] = 1;
+        zerocopy.next++;
+    }
+#endif
 
-    if (bytes_sent == SOCKET_ERROR)
+    if (result == SOCKET_ERROR)
         return ERR_SEND;
     return 0;
 }
 
-int send_block_burst(client_s* client, const char* mapping, size_t len, wait_signal_s* signal) {
-    for (int i = 0; i < signal->num_sections; i++) {
-        int capacity = signal->sections[i].capacity;
-        int section = signal->sections[i].section;
-        for (int j = 0; j < capacity; j++) {
-            // make a fountain
-            // send it across the air
-            fountain_s* ftn = make_fountain(mapping, blk_size, len, section, section_size);
-            if (ftn == NULL) return ERR_MEM;
-            int error = send_fountain(client, ftn);
-            if (error < 0) handle_error(error, NULL);
-            free_fountain(ftn);
+/*
+ * Queue a packet from the store to go out with the others in the batch, as
+ * they are already packed there is nothing else to do. Without sendmmsg it
+ * is sent straight away.
+ */
+int udp_send_packed(client_s * client, const char* packet, int length) {
+#ifdef HAVE_SENDMMSG
+    int i = batch.count++;
+    batch.iov[i] = (struct iovec) {
+        .iov_base = (char*)packet,
+        .iov_len = length
+    };
+    batch.msgs[i] = (struct mmsghdr) {
+        .msg_hdr = {
+            .msg_name = &client->address,
+            .msg_namelen = sizeof client->address,
+            .msg_iov = batch.iov + i,
+            .msg_iovlen = 1
+        }
+    };
+    return (batch.count == SEND_BATCH) ? send_batch() : 0;
+#else
+    int bytes_sent = sendto(s, packet, length, 0,
+            (struct sockaddr*)&client->address,
+            sizeof client->address);
+    return (bytes_sent == SOCKET_ERROR) ? ERR_SEND : 0;
+#endif
+}
+
+/* Send every stored packet still queued */
+int send_batch() {
+#ifdef HAVE_SENDMMSG
+    for (int sent = 0; sent < batch.count; ) {
+        int n = sendmmsg(s, batch.msgs + sent, batch.count - sent, 0);
+        if (n < 0 && errno != EINTR) {
+            batch.count = 0;
+            return ERR_SEND;
         }
-        log_info("Sent packet burst of size %d for section %d", capacity, section);
+        if (n > 0)
+            sent += n;
     }
+    batch.count = 0;
+#endif
+    return 0;
+}
+
+/* A client we send to has handed us nothing to let go of */
+void udp_close(client_s * client) {
+}
+
+#ifdef HAVE_SHMRING
+/*
+ * Nothing is lost in a ring, it fills up instead, so a client with one is
+ * held back by the room left in it rather than by its pacer
+ */
+int shm_allows(client_s* client, uint64_t now, int64_t* wait_usec) {
+    if (shmring_fits(client->ring, PACKED_FTN_SIZE(client->wire,
+                                                   client->blk_size)))
+        return 1;
+    if (*wait_usec < 0 || RING_FULL_USEC < *wait_usec)
+        *wait_usec = RING_FULL_USEC;
+    return 0;
+}
+
+/* Pack the header and copy the payload straight into the client's ring */
+int shm_send(client_s * client, fountain_s* ftn, int from_mapping) {
+    char* packet = shmring_claim(client->ring,
+                                 PACKED_FTN_SIZE(client->wire, ftn->blk_size));
+    if (!packet) {
+        debug("No room in the ring, dropped the packet");
+        return 0;
+    }
+    int header_size = pack_fountain_header(ftn, client->wire, packet);
+    memcpy(packet + header_size, ftn->string, ftn->blk_size);
+    shmring_publish(client->ring, header_size + ftn->blk_size);
+    ring_sent++;
     return 0;
 }
 
+int shm_send_packed(client_s * client, const char* packet, int length) {
+    char* slot = shmring_claim(client->ring, length);
+    if (!slot) {
+        debug("No room in the ring, dropped the packet");
+        return 0;
+    }
+    memcpy(slot, packet, length);
+    shmring_publish(client->ring, length);
+    ring_sent++;
+    return 0;
+}
+
+/* Let go of the client's ring, its packets go over UDP again */
+void shm_close(client_s * client) {
+    shmring_free(client->ring);
+    client->ring = NULL;
+    client->transport = &udp_transport;
+}
+#endif
+
+/*
+ * What we expect to send the client that has just asked for its bursts, to
+ * encode while we wait for its pacer: the symbols of each burst and then, as
+ * clients move through the file in order, what it is likely to ask for of
+ * the sections after those it asked for this time.
+ */
+static void plan_speculation(client_s* client, wait_signal_s* signal) {
+    if (!cache_serves(client))
+        return;
+    for (int b = 0; b < client->num_bursts; b++) {
+        int section = client->bursts[b].section;
+        uint32_t next = client->next_id[section];
+        client->spec[client->num_spec++] = (spec_run_s) {
+            .section = section,
+            .next = next,
+            .end = next + client->bursts[b].remaining
+        };
+    }
+
+    int last = -1;
+    for (int i = 0; i < signal->num_sections; i++)
+        if (signal->sections[i].section > last)
+            last = signal->sections[i].section;
+    int num_ahead = (signal->num_sections < SPEC_SECTIONS)
+                    ? signal->num_sections : SPEC_SECTIONS;
+    for (int section = last + 1; num_ahead > 0 && section < num_sections;
+            section++) {
+        if (IsBitSet(client->done, section))
+            continue;
+        uint32_t next = client->next_id[section];
+        client->spec[client->num_spec++] = (spec_run_s) {
+            .section = section,
+            .next = next,
+            .end = next + SPEC_RUN(client->section_size)
+        };
+        num_ahead--;
+    }
+}
+
+/*
+ * A new wait signal tells us everything the client currently has room for,
+ * so it replaces whatever was still queued for that client. A group member
+ * also tells us the group symbols it had got, anything the group sent after
+ * those is still on its way and counts towards what it asks for, as does
+ * the group's latest run of a section it has had none of. Unless the group is
+ * still sending the section they were likely lost. No client gets more queued
+ * than it could need, whatever it asks for.
+ */
+void queue_block_burst(client_s* client, wait_signal_s* signal, int length) {
+    client->num_bursts = 0;
+    client->num_spec = client->spec_at = 0;
+    if (!client->next_id || !client->done) {
+        handle_error(ERR_MEM, NULL);
+        return;
+    }
+    const uint64_t now = monotonic_usec();
+    // going by the shortest delay any member has seen, as a request that
+    // was all in flight takes that much longer to be answered
+    const uint64_t in_flight_usec =
+        (group.pacer.min_delay + IN_FLIGHT_SLACK) * 1000ULL;
+    const char* seen = (client->multicast
+                        && length >= WAIT_SIGNAL_SEEN_SIZE(signal->num_sections))
+                       ? (char*)signal + WAIT_SIGNAL_SIZE(signal->num_sections)
+                       : NULL;
+    // However much it asks for, what a single message costs us is bounded
+    const int max_section = MAX_SECTION_BURST(client->section_size);
+    int outstanding = MAX_OUTSTANDING(client->section_size);
+    for (int i = 0; i < signal->num_sections && outstanding > 0; i++) {
+        int section = signal->sections[i].section;
+        int remaining = signal->sections[i].capacity;
+        if (remaining > max_section)
+            remaining = max_section;
+        if (remaining == 0 || section >= num_sections
+                || IsBitSet(client->done, section))
+            continue;
+        struct group_section_s* gsec = group_sections + section;
+        if (seen && now - gsec->sent_at < in_flight_usec) {
+            uint32_t id;
+            memcpy(&id, seen + i * sizeof id, sizeof id);
+            id = ntohl(id);
+            // 0 if it has had none, maybe it joined after they were sent
+            if (id == 0)
+                id = (now - gsec->run_at < in_flight_usec)
+                     ? gsec->run_id : group.next_id[section];
+            int32_t in_flight = group.next_id[section] - id;
+            if (in_flight > 0)
+                remaining -= in_flight;
+            if (remaining <= 0)
+                continue;
+        }
+        if (remaining > outstanding)
+            remaining = outstanding;
+        outstanding -= remaining;
+        client->bursts[client->num_bursts].section = section;
+        client->bursts[client->num_bursts].remaining = remaining;
+        client->num_bursts++;
+    }
+    plan_speculation(client, signal);
+}
+
+/*
+ * The client has decoded these sections, so stop sending them. Once it has
+ * them all its session is over and its record the first to be reused.
+ */
+void client_note_done(client_s* client, done_signal_s* signal, int length) {
+    const int num_bits = ntohs(signal->num_bits);
+    if (length < sizeof *signal || length < DONE_SIGNAL_SIZE(num_bits)) {
+        log_warn("Short done signal: %d bytes", length);
+        return;
+    }
+    if (!client->done) {
+        handle_error(ERR_MEM, NULL);
+        return;
+    }
+    int first = ntohs(signal->first);
+    if (first > num_sections)
+        first = num_sections;
+    for (int section = client->done_below; section < first; section++) {
+        if (!IsBitSet(client->done, section)) {
+            SetBit(client->done, section);
+            client->num_done++;
+        }
+    }
+    if (first > client->done_below)
+        client->done_below = first;
+    for (int i = 0; i < num_bits && first + i < num_sections; i++) {
+        if ((signal->bits[i / 8] >> (i % 8) & 1)
+                && !IsBitSet(client->done, first + i)) {
+            SetBit(client->done, first + i);
+            client->num_done++;
+        }
+    }
+
+    int kept = 0;
+    for (int b = 0; b < client->num_bursts; b++)
+        if (!IsBitSet(client->done, client->bursts[b].section))
+            client->bursts[kept++] = client->bursts[b];
+    client->num_bursts = kept;
+
+    if (client->num_done == num_sections) {
+        uint64_t sent = 0;
+        for (int section = 0; section < num_sections; section++)
+            sent += client->next_id[section];
+        log_info("%s:%d has all %d sections after %" PRIu64 " packets",
+                 inet_ntoa(client->address.sin_addr),
+                 ntohs(client->address.sin_port), num_sections, sent);
+        if (cache) {
+            uint64_t hits, misses;
+            symcache_stats(cache, &hits, &misses);
+            log_info("Sent %" PRIu64 " packets from the cache so far, %"
+                     PRIu64 " were not in it", hits, misses);
+        }
+        if (store)
+            log_info("Sent %" PRIu64 " packets from the store so far",
+                     store_sent);
+        if (ring_path)
+            log_info("Put %" PRIu64 " packets in shared memory rings so far",
+                     ring_sent);
+        // it has nothing left to read from its ring
+        client->transport->close(client);
+        client->last_seen = 0;
+    }
+}
+
+/*
+ * Take a packet of section off what the client has queued
+ */
+static void client_burst_sent(client_s* client, int section) {
+    for (int b = 0; b < client->num_bursts; b++) {
+        if (client->bursts[b].section != section)
+            continue;
+        if (--client->bursts[b].remaining == 0) {
+            log_info("Sent packet burst for section %d", section);
+            memmove(client->bursts + b, client->bursts + b + 1,
+                    (--client->num_bursts - b) * sizeof client->bursts[0]);
+        }
+        return;
+    }
+}
+
+static int packet_bytes(client_s* sender) {
+    return PACKED_FTN_SIZE(sender->wire, sender->blk_size) + UDP_OVERHEAD;
+}
+
+/*
+ * Whether the sender's pacer lets a packet through now, and for an
+ * unverified client the budget they share, if not lowers wait_usec to when
+ * they will
+ */
+int udp_allows(client_s* sender, uint64_t now, int64_t* wait_usec) {
+    const int bytes = packet_bytes(sender);
+    pacer_refill(&sender->pacer, now);
+    int64_t sender_wait = pacer_wait_usec(&sender->pacer, bytes);
+    if (!sender->verified) {
+        pacer_refill(&unverified, now);
+        int64_t shared_wait = pacer_wait_usec(&unverified, bytes);
+        if (shared_wait > sender_wait)
+            sender_wait = shared_wait;
+    }
+    if (sender_wait > 0) {
+        if (*wait_usec < 0 || sender_wait < *wait_usec)
+            *wait_usec = sender_wait;
+        return 0;
+    }
+    sender->pacer.tokens -= bytes;
+    if (!sender->verified)
+        unverified.tokens -= bytes;
+    return 1;
+}
+
+/*
+ * Deficit round robin: every round a sender with work gets a quantum of bytes
+ * on top of what it had left, and may send packets while it has enough for
+ * them and its pacer allows. Encoding a packet costs about what sending it
+ * does, so the one budget shares out both fairly, however big each client's
+ * packets are. Credit it could not use for its pacer is only kept up to a
+ * quantum, it does not get to save up for a burst.
+ * returns whether the sender has a packet it may send now
+ */
+static int drr_allows(client_s* sender, uint64_t now, int64_t* wait_usec,
+                      int new_round) {
+    const int bytes = packet_bytes(sender);
+    if (new_round)
+        sender->deficit += DRR_QUANTUM;
+    if (sender->deficit < bytes) {
+        *wait_usec = 0; // it can go next round
+        return 0;
+    }
+    if (!sender->transport->allows(sender, now, wait_usec)) {
+        if (sender->deficit > DRR_QUANTUM && sender->deficit > bytes)
+            sender->deficit = (bytes > DRR_QUANTUM) ? bytes : DRR_QUANTUM;
+        return 0;
+    }
+    sender->deficit -= bytes;
+    return 1;
+}
+
+/*
+ * Whether the sender's packets are packed the way those in the store are,
+ * and so may be sent from it
+ */
+static int store_serves(client_s* sender) {
+    return store && sender != &group
+        && sender->wire.nonce == store->wire.nonce
+        && sender->wire.version == store->wire.version
+        && sender->wire.checksum == store->wire.checksum
+        && sender->blk_size == store->blk_size;
+}
+
+/* Whether the sender's packets may be kept in the cache for other clients */
+static int cache_serves(client_s* sender) {
+    return cache && sender != &group && !sender->multicast
+        && sender->wire.nonce;
+}
+
+/* Keep a packet that took more than a single block to encode */
+static void cache_fountain(symcache_key_s* key, fountain_s* ftn) {
+    char* slot = symcache_put(cache, key);
+    if (slot) {
+        memcpy(slot, ftn, sizeof *ftn);
+        memcpy(slot + sizeof *ftn, ftn->string, ftn->blk_size);
+    }
+}
+
+/*
+ * Send the next packet of section in the sender's stream from the store if it
+ * has it, otherwise encode it. A unicast packet that took more than a single
+ * block goes in the cache in case another client is sent it too, the group
+ * never sends one twice.
+ */
+static void send_next_packet(client_s* sender, int section,
+                             const char* mapping, size_t len, char* scratch) {
+    uint32_t id = sender->next_id[section]++;
+    const char* packet;
+    int length, error;
+    if (store_serves(sender)
+            && (packet = store_packet(store, section, id, &length))) {
+        store_sent++;
+        if ((error = sender->transport->send_packed(sender, packet, length)) < 0)
+            handle_error(error, NULL);
+        return;
+    }
+
+    // make a fountain
+    // send it across the air
+    fountain_s ftn;
+    symcache_key_s key = {
+        .nonce = sender->wire.nonce,
+        .symbol_id = id,
+        .section = section,
+        .blk_size = sender->blk_size
+    };
+    int cacheable = cache_serves(sender);
+    char* slot = cacheable ? symcache_get(cache, &key) : NULL;
+    const int hit = slot != NULL;
+    if (hit) {
+        memcpy(&ftn, slot, sizeof ftn);
+        ftn.string = slot + sizeof ftn;
+    } else {
+        encode_fountain(&ftn, scratch, mapping, sender->blk_size, len,
+                        section, sender->section_size, sender->wire.nonce,
+                        sender->wire.nonce ? id : (uint32_t)rand());
+        if (cacheable && ftn.string == scratch)
+            cache_fountain(&key, &ftn);
+    }
+    // a cached packet can be put out of the cache before the kernel is done
+    error = sender->transport->send(sender, &ftn, ftn.string != scratch && !hit);
+    if (error < 0) handle_error(error, NULL);
+}
+
+/*
+ * Encode up to SPEC_STEP of the packets we expect to send the client into the
+ * cache, skipping any that are already there or in the store
+ * returns the number encoded
+ */
+static int speculate_client(client_s* client, const char* mapping,
+                            size_t len, char* scratch) {
+    int encoded = 0;
+    while (client->spec_at < client->num_spec && encoded < SPEC_STEP) {
+        spec_run_s* spec = client->spec + client->spec_at;
+        uint32_t sent = client->next_id[spec->section];
+        if ((int32_t)(spec->next - sent) < 0)
+            spec->next = sent;
+        if (spec->next >= spec->end
+                || IsBitSet(client->done, spec->section)) {
+            client->spec_at++;
+            continue;
+        }
+        symcache_key_s key = {
+            .nonce = client->wire.nonce,
+            .symbol_id = spec->next++,
+            .section = spec->section,
+            .blk_size = client->blk_size
+        };
+        int length;
+        if ((store_serves(client)
+                && store_packet(store, key.section, key.symbol_id, &length))
+                || symcache_contains(cache, &key))
+            continue;
+
+        fountain_s ftn;
+        encode_fountain(&ftn, scratch, mapping, client->blk_size, len,
+                        key.section, client->section_size, key.nonce,
+                        key.symbol_id);
+        if (ftn.string == scratch)
+            cache_fountain(&key, &ftn);
+        encoded++;
+    }
+    return encoded;
+}
+
+/*
+ * Until the pacers let us send again, or for as long as there is nothing to
+ * send, encode what clients are likely to be sent next so that it can go out
+ * straight from the cache. Each client takes its turn for a few packets at a
+ * time, and we stop as soon as a request comes in. Only clients that have
+ * shown us they are at their address get any of this work.
+ * returns what is left of wait_usec, 0 if there is a request to see to
+ */
+int64_t speculate(const char* mapping, size_t len, int64_t wait_usec) {
+    if (!cache)
+        return wait_usec;
+    char scratch[blk_size];
+    // a ring handed to us is as much a request as one over UDP
+    struct pollfd pfds[2] = {
+        { .fd = s, .events = POLLIN, .revents = 0 },
+        { .fd = us, .events = POLLIN, .revents = 0 }
+    };
+    const int nfds = (us != INVALID_SOCKET) ? 2 : 1;
+    const uint64_t start = monotonic_usec();
+    int64_t elapsed = 0;
+    int encoded;
+    do {
+        encoded = 0;
+        for (int i = 0; i < num_clients; i++) {
+            if (clients[i].verified && clients[i].num_done < num_sections)
+                encoded += speculate_client(clients + i, mapping, len, scratch);
+        }
+        if (encoded && poll(pfds, nfds, 0) != 0)
+            return 0;
+        elapsed = monotonic_usec() - start;
+        if (wait_usec >= 0 && elapsed >= wait_usec)
+            return 0;
+    } while (encoded);
+    return (wait_usec < 0) ? -1 : wait_usec - elapsed;
+}
+
+/*
+ * The group member whose oldest request goes next, taking turns so that
+ * every member's requests move along
+ */
+static client_s* group_next_member() {
+    for (int i = 0; i < num_clients; i++) {
+        client_s* client = clients + (group_next + i) % num_clients;
+        if (client->multicast && client->num_bursts > 0) {
+            group_next = (client - clients + 1) % num_clients;
+            return client;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Send the carousel's next packet, and every so often before it the file
+ * info or the next run of digests
+ */
+static void carousel_step(const char* filename, const char* mapping,
+                          size_t len, char* scratch) {
+    if (carousel_sent++ % CAROUSEL_CONTROL_EVERY == 0) {
+        int num_chunks = (num_sections + MAX_DIGESTS_PER_MSG - 1)
+                         / MAX_DIGESTS_PER_MSG;
+        int error;
+        if (carousel_controls++ % CAROUSEL_INFO_EVERY == 0) {
+            error = send_info(&group, filename);
+        } else {
+            error = send_digest_chunk(&group,
+                                      carousel_chunk * MAX_DIGESTS_PER_MSG,
+                                      MAX_DIGESTS_PER_MSG);
+            carousel_chunk = (carousel_chunk + 1) % num_chunks;
+        }
+        if (error < 0) handle_error(error, NULL);
+    }
+    if (carousel_left == 0) {
+        carousel_section = (carousel_section + 1) % num_sections;
+        carousel_left = CAROUSEL_RUN(group.section_size);
+    }
+    send_next_packet(&group, carousel_section, mapping, len, scratch);
+    carousel_left--;
+}
+
+/*
+ * Sends to each client with queued work in deficit round robin rounds, for as
+ * long as their pacers allow. The group takes its turn as one more client.
+ * Every packet sent to the group counts towards what each of its members
+ * asked for, so a section is sent once however many want it. A carousel has
+ * no end of work and sends whenever its pacer allows. So that requests are
+ * never kept waiting long we stop after SEND_BUDGET_USEC, which is also as
+ * long as packets from the store wait to go out in a batch.
+ * returns the usec until the next packet may be sent or -1 if there is no
+ *         more work queued
+ */
+int64_t send_paced_bursts(const char* filename, const char* mapping,
+                          size_t len) {
+    char scratch[blk_size];
+    int64_t wait_usec;
+    int progress;
+    const uint64_t start = monotonic_usec();
+    do {
+        progress = 0;
+        wait_usec = -1;
+        uint64_t now = monotonic_usec();
+        if (now - start > SEND_BUDGET_USEC) {
+            wait_usec = 0;
+            break;
+        }
+        for (int i = 0; i < num_clients; i++) {
+            client_s* client = clients + i;
+            if (client->multicast)
+                continue;
+            if (client->num_bursts == 0) {
+                client->deficit = 0;
+                continue;
+            }
+            for (int new_round = 1; client->num_bursts > 0
+                    && drr_allows(client, now, &wait_usec, new_round);
+                    new_round = 0) {
+                int section = client->bursts[0].section;
+                send_next_packet(client, section, mapping, len, scratch);
+                client_burst_sent(client, section);
+                progress = 1;
+            }
+        }
+
+        if (group_enabled && carousel_rate > 0) {
+            for (int new_round = 1;
+                    drr_allows(&group, now, &wait_usec, new_round);
+                    new_round = 0) {
+                carousel_step(filename, mapping, len, scratch);
+                progress = 1;
+            }
+            continue;
+        }
+        client_s* member = group_enabled ? group_next_member() : NULL;
+        if (!member)
+            group.deficit = 0;
+        for (int new_round = 1; member
+                && drr_allows(&group, now, &wait_usec, new_round);
+                new_round = 0) {
+            int section = member->bursts[0].section;
+            struct group_section_s* gsec = group_sections + section;
+            if (now - gsec->sent_at > IN_FLIGHT_SLACK * 1000ULL) {
+                gsec->run_at = now;
+                gsec->run_id = group.next_id[section];
+            }
+            gsec->sent_at = now;
+            send_next_packet(&group, section, mapping, len, scratch);
+            for (int i = 0; i < num_clients; i++) {
+                if (clients[i].multicast)
+                    client_burst_sent(clients + i, section);
+            }
+            progress = 1;
+            member = group_next_member();
+        }
+        if (member)
+            group_next = member - clients; // keep its turn
+    } while (progress || wait_usec == 0);
+
+    int error = send_batch();
+    if (error < 0) handle_error(error, NULL);
+    return wait_usec;
+}
+
@@ -0,0 +1,35 @@
+#ifndef __SHA256_H__
+#define __SHA256_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_SIZE 32
+
+typedef struct sha256_s {
+    uint32_t state[8];
+    uint64_t length;        /* bytes hashed so far */
+    uint8_t buffer[64];     /* the part of a block still to be hashed */
+} sha256_s;
+
+void sha256_init(sha256_s* ctx);
+void sha256_update(sha256_s* ctx, const void* data, size_t length);
+void sha256_final(sha256_s* ctx, uint8_t digest[SHA256_SIZE]);
+
+/*
+ * Digest of one section of the file, as used for the leaves of the Merkle
+ * tree. Prefixed with a 0 byte so that a leaf can never pass for one of the
+ * inner nodes, which are prefixed with a 1.
+ */
+void section_digest(const char* data, size_t length,
+                    uint8_t digest[SHA256_SIZE]);
+
+/*
+ * The root of the Merkle tree over num_sections section digests stored one
+ * after the other. A node without a sibling is carried up a level as is.
+ * returns 0 or ERR_MEM
+ */
+int merkle_root(const uint8_t* digests, int num_sections,
+                uint8_t root[SHA256_SIZE]);
+
+#endif /* __SHA256_H__ */
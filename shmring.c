@@ -0,0 +1,252 @@
+#define _GNU_SOURCE
+#include "shmring.h"
+
+#ifdef HAVE_SHMRING
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <fcntl.h>          // F_ADD_SEALS
+#include <sys/mman.h>       // memfd_create mmap
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+
+#include "dbg.h"
+
+#define CACHE_LINE      64
+#define SHMRING_MAGIC   0x52494e47 /* 'RING' */
+#define RECORD_HEADER   8       /* the length, and the packet stays aligned */
+#define WRAP            0       /* length of a record that says to go back to
+                                   the start of the ring */
+#define SEALS           (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL)
+
+/*
+ * What the two processes share, ahead of the packets. Each side only ever
+ * writes its own position, on a cache line of its own.
+ */
+typedef struct shared_s {
+    uint32_t magic;
+    uint32_t pad;
+    uint64_t size;              /* bytes of packets */
+    char pad0[CACHE_LINE - 16];
+    _Atomic uint64_t head;      /* bytes ever published */
+    char pad1[CACHE_LINE - sizeof(uint64_t)];
+    _Atomic uint64_t tail;      /* bytes ever released */
+    char pad2[CACHE_LINE - sizeof(uint64_t)];
+    _Atomic int waiting;        /* the consumer is waiting on the eventfd */
+} shared_s;
+
+#define PACKETS_AT  ((sizeof(shared_s) + CACHE_LINE - 1) & ~(CACHE_LINE - 1))
+
+/*
+ * Each side's own view. The producer keeps the head here rather than trust
+ * the consumer not to have moved it, so however the consumer scribbles on
+ * the ring we never write outside it.
+ */
+struct shmring_s {
+    shared_s* shared;
+    char* packets;
+    size_t mapped;
+    uint64_t mask;
+    uint64_t at;        /* the producer's head or the consumer's tail */
+    uint64_t next;      /* where the consumer's tail moves to once the
+                           packet it peeked at is done with */
+    int memfd;
+    int eventfd;
+};
+
+static uint64_t record_size(uint64_t length) {
+    return (RECORD_HEADER + length + RECORD_HEADER - 1)
+           & ~(uint64_t)(RECORD_HEADER - 1);
+}
+
+static shmring_s* ring_map(int memfd, int efd, size_t mapped) {
+    shmring_s* ring = calloc(1, sizeof *ring);
+    if (!ring) return NULL;
+    void* mapping = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_SHARED,
+                         memfd, 0);
+    if (mapping == MAP_FAILED) {
+        free(ring);
+        return NULL;
+    }
+    ring->shared = mapping;
+    ring->packets = (char*)mapping + PACKETS_AT;
+    ring->mapped = mapped;
+    ring->mask = mapped - PACKETS_AT - 1;
+    ring->memfd = memfd;
+    ring->eventfd = efd;
+    return ring;
+}
+
+shmring_s* shmring_new(size_t size) {
+    size_t n = CACHE_LINE;
+    while (n < size) n <<= 1;
+    const size_t mapped = PACKETS_AT + n;
+
+    int memfd = memfd_create("fountain-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (memfd < 0) {
+        log_err("Unable to make the shared memory for the ring");
+        return NULL;
+    }
+    int efd = -1;
+    if (ftruncate(memfd, mapped) < 0 || fcntl(memfd, F_ADD_SEALS, SEALS) < 0
+            || (efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0) {
+        log_err("Unable to set up the shared memory for the ring");
+        goto close_fds;
+    }
+    shmring_s* ring = ring_map(memfd, efd, mapped);
+    if (!ring) {
+        log_err("Unable to map the ring");
+        goto close_fds;
+    }
+    ring->shared->magic = SHMRING_MAGIC;
+    ring->shared->size = n;
+    return ring;
+
+close_fds:
+    if (efd >= 0) close(efd);
+    close(memfd);
+    return NULL;
+}
+
+shmring_s* shmring_attach(int memfd, int efd) {
+    struct stat st;
+    int seals = fcntl(memfd, F_GET_SEALS);
+    if (seals < 0 || (seals & SEALS) != SEALS || fstat(memfd, &st) < 0
+            || st.st_size <= (off_t)PACKETS_AT) {
+        log_warn("The ring is not sealed shared memory");
+        goto close_fds;
+    }
+    size_t size = st.st_size - PACKETS_AT;
+    if (size & (size - 1)) {
+        log_warn("The ring is %zu bytes, not a power of 2", size);
+        goto close_fds;
+    }
+    // we write to it in the middle of sending, so it must never block us
+    if (fcntl(efd, F_SETFL, O_NONBLOCK) < 0) {
+        log_warn("Unable to use the ring's eventfd");
+        goto close_fds;
+    }
+    shmring_s* ring = ring_map(memfd, efd, st.st_size);
+    if (!ring) {
+        log_warn("Unable to map the ring");
+        goto close_fds;
+    }
+    if (ring->shared->magic != SHMRING_MAGIC || ring->shared->size != size) {
+        log_warn("The ring was not set up for us");
+        shmring_free(ring);
+        return NULL;
+    }
+    ring->at = atomic_load(&ring->shared->head);
+    return ring;
+
+close_fds:
+    close(efd);
+    close(memfd);
+    return NULL;
+}
+
+void shmring_free(shmring_s* ring) {
+    if (!ring) return;
+    munmap(ring->shared, ring->mapped);
+    close(ring->eventfd);
+    close(ring->memfd);
+    free(ring);
+}
+
+int shmring_memfd(shmring_s* ring) {
+    return ring->memfd;
+}
+
+int shmring_eventfd(shmring_s* ring) {
+    return ring->eventfd;
+}
+
+/* bytes to skip to the end of the ring for a record, 0 if it fits before */
+static uint64_t wrap_skip(shmring_s* ring, uint64_t record) {
+    const uint64_t size = ring->mask + 1;
+    const uint64_t pos = ring->at & ring->mask;
+    return (size - pos < record) ? size - pos : 0;
+}
+
+int shmring_fits(shmring_s* ring, int length) {
+    const uint64_t size = ring->mask + 1;
+    const uint64_t record = record_size(length);
+    // a packet never straddles the end, we go back to the start for it
+    const uint64_t skip = wrap_skip(ring, record);
+    const uint64_t used = ring->at - atomic_load(&ring->shared->tail);
+    return used <= size && size - used >= skip + record;
+}
+
+char* shmring_claim(shmring_s* ring, int length) {
+    if (!shmring_fits(ring, length))
+        return NULL;
+    const uint64_t skip = wrap_skip(ring, record_size(length));
+    const uint64_t pos = ring->at & ring->mask;
+
+    if (skip) {
+        *(uint32_t*)(ring->packets + pos) = WRAP;
+        ring->at += skip;
+    }
+    return ring->packets + (ring->at & ring->mask) + RECORD_HEADER;
+}
+
+void shmring_publish(shmring_s* ring, int length) {
+    *(uint32_t*)(ring->packets + (ring->at & ring->mask)) = length;
+    ring->at += record_size(length);
+    atomic_store(&ring->shared->head, ring->at);
+    if (atomic_load(&ring->shared->waiting)
+            && atomic_exchange(&ring->shared->waiting, 0)) {
+        uint64_t one = 1;
+        if (write(ring->eventfd, &one, sizeof one) < 0)
+            debug("The consumer's eventfd is full");
+    }
+}
+
+char* shmring_peek(shmring_s* ring, int* length) {
+    const uint64_t size = ring->mask + 1;
+    for (;;) {
+        if (ring->at == atomic_load(&ring->shared->head))
+            return NULL;
+        const uint64_t pos = ring->at & ring->mask;
+        uint32_t n = *(uint32_t*)(ring->packets + pos);
+        if (n == WRAP) {
+            ring->at += size - pos;
+            atomic_store(&ring->shared->tail, ring->at);
+            continue;
+        }
+        if (record_size(n) > size - pos) {
+            // the producer has lost track, start again from wherever it is
+            log_warn("Corrupt packet ring");
+            ring->at = atomic_load(&ring->shared->head);
+            atomic_store(&ring->shared->tail, ring->at);
+            return NULL;
+        }
+        ring->next = ring->at + record_size(n);
+        *length = n;
+        return ring->packets + pos + RECORD_HEADER;
+    }
+}
+
+void shmring_release(shmring_s* ring) {
+    ring->at = ring->next;
+    atomic_store(&ring->shared->tail, ring->at);
+}
+
+int shmring_sleep(shmring_s* ring) {
+    atomic_store(&ring->shared->waiting, 1);
+    // the producer may have published just before seeing us waiting
+    if (ring->at != atomic_load(&ring->shared->head)) {
+        atomic_store(&ring->shared->waiting, 0);
+        return 0;
+    }
+    return 1;
+}
+
+void shmring_woken(shmring_s* ring) {
+    uint64_t count;
+    if (read(ring->eventfd, &count, sizeof count) < 0)
+        debug("Woken with nothing to read");
+}
+
+#endif /* HAVE_SHMRING */
@@ -0,0 +1,61 @@
+#ifndef __SHMRING_H__
+#define __SHMRING_H__
+
+#include <stddef.h>
+#include "platform.h"
+
+#if defined(__linux__)
+#   define HAVE_SHMRING
+#endif
+
+/*
+ * A ring of packets in shared memory, for a server to hand a client on the
+ * same host its packets without either of them going through the network
+ * stack.
+ *
+ * The client makes the ring in a sealed memfd, so that it cannot shrink under
+ * the server, and passes it with an eventfd over a unix socket. Each packet
+ * is exactly what would have gone in a datagram, after its length. There is
+ * one producer, the server, and one consumer. A consumer that finds the ring
+ * empty may wait on the eventfd, which the producer only writes to while the
+ * consumer says it is waiting. Rather than drop a packet that does not fit,
+ * the producer holds off until shmring_fits says there is room for it, so
+ * nothing is lost in a ring the way it would be in the network.
+ */
+typedef struct shmring_s shmring_s;
+
+/* A ring of size bytes of packets, rounded up to a power of 2 */
+shmring_s* shmring_new(size_t size) __malloc;
+/*
+ * Map the ring a client made, taking ownership of both descriptors, NULL if
+ * it is not one we can trust to stay mapped
+ */
+shmring_s* shmring_attach(int memfd, int efd) __malloc;
+void shmring_free(shmring_s* ring);
+
+/* to pass to the producer */
+int shmring_memfd(shmring_s* ring);
+int shmring_eventfd(shmring_s* ring);
+
+/* Producer: whether a packet of length bytes would fit now */
+int shmring_fits(shmring_s* ring, int length);
+/* returns where to put a packet of length bytes, NULL if full */
+char* shmring_claim(shmring_s* ring, int length);
+/*
+ * hands the claimed packet over, which may have come to less than was
+ * claimed, waking the consumer if it is waiting
+ */
+void shmring_publish(shmring_s* ring, int length);
+
+/* Consumer: the oldest packet, NULL if there is none */
+char* shmring_peek(shmring_s* ring, int* length);
+void shmring_release(shmring_s* ring);
+/*
+ * Say that we are about to wait on the eventfd, returns 0 if a packet came
+ * in the meantime and we should not
+ */
+int shmring_sleep(shmring_s* ring);
+/* Once the eventfd is readable, so that it can wake us again */
+void shmring_woken(shmring_s* ring);
+
+#endif /* __SHMRING_H__ */
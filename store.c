@@ -0,0 +1,258 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "store.h"
+#include "crc32c.h"
+#include "mapping.h" // map_file_read unmap_file
+#include "dbg.h"
+
+static void put_be(uint8_t* p, uint64_t value, int bytes) {
+    for (int i = bytes - 1; i >= 0; i--, value >>= 8)
+        p[i] = value;
+}
+
+static uint64_t get_be(const uint8_t* p, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++)
+        value = value << 8 | p[i];
+    return value;
+}
+
+static void pack_header(const store_s* store, uint32_t body_crc, uint8_t* h) {
+    memcpy(h, STORE_MAGIC, 8);
+    put_be(h + 8, STORE_VERSION, 2);
+    put_be(h + 10, store->wire.version, 2);
+    put_be(h + 12, store->wire.checksum, 2);
+    put_be(h + 14, 0, 2);
+    put_be(h + 16, store->wire.nonce, 4);
+    put_be(h + 20, store->blk_size, 4);
+    put_be(h + 24, store->section_size, 4);
+    put_be(h + 28, store->num_sections, 4);
+    put_be(h + 32, store->filesize, 8);
+    memcpy(h + 40, store->merkle_root, SHA256_SIZE);
+    put_be(h + 72, body_crc, 4);
+}
+
+static void pack_index(const store_section_s* sec, uint8_t* p) {
+    put_be(p, sec->offset, 8);
+    put_be(p + 8, sec->num_symbols, 4);
+    put_be(p + 12, sec->packet_size, 4);
+}
+
+/*
+ * Write num_symbols packets of every section from offset on, filling in the
+ * index, the digest of each section and the CRC32C of all the packets
+ * returns 0 or an error code
+ */
+static int write_packets(FILE* f, store_s* store, const char* data,
+                         int num_symbols, uint64_t offset, uint8_t* index,
+                         uint8_t* digests, uint32_t* body_crc) {
+    const int blk_size = store->blk_size;
+    const size_t length = store->filesize;
+    const size_t bytes_per_section = (size_t)blk_size * store->section_size;
+    char scratch[blk_size];
+    char packet[PACKED_FTN_SIZE(store->wire, blk_size)];
+    *body_crc = 0;
+    for (int s = 0; s < store->num_sections; s++) {
+        size_t start = s * bytes_per_section;
+        section_digest(data + start, length - start < bytes_per_section
+                                     ? length - start : bytes_per_section,
+                       digests + s * SHA256_SIZE);
+
+        store_section_s* sec = store->sections + s;
+        sec->offset = offset;
+        sec->num_symbols = num_symbols;
+        for (int id = 0; id < sec->num_symbols; id++) {
+            fountain_s ftn;
+            encode_fountain(&ftn, scratch, data, blk_size, length, s,
+                            store->section_size, store->wire.nonce, id);
+            int header_size = pack_fountain_header(&ftn, store->wire, packet);
+            memcpy(packet + header_size, ftn.string, blk_size);
+            // the same for every packet of a section
+            sec->packet_size = header_size + blk_size;
+            if (fwrite(packet, sec->packet_size, 1, f) != 1)
+                return ERR_BWRITE;
+            *body_crc = crc32c(*body_crc, packet, sec->packet_size);
+            offset += sec->packet_size;
+        }
+        pack_index(sec, index + s * STORE_INDEX_SIZE);
+    }
+    return 0;
+}
+
+int store_write(const char* filename, const char* data, size_t length,
+                int blk_size, int section_size, int num_symbols,
+                uint32_t nonce) {
+    int result = 0;
+    size_t bytes_per_section = (size_t)blk_size * section_size;
+    store_s store = {
+        .wire = { FTN_WIRE_V2, FTN_CHECKSUM_CRC32C, nonce },
+        .blk_size = blk_size,
+        .section_size = section_size,
+        .num_sections = (length + bytes_per_section - 1) / bytes_per_section,
+        .filesize = length
+    };
+    const size_t index_size = (size_t)store.num_sections * STORE_INDEX_SIZE;
+    uint8_t* digests = malloc(store.num_sections * SHA256_SIZE + 1);
+    store.sections = calloc(store.num_sections + 1, sizeof *store.sections);
+    uint8_t* index = malloc(index_size + 1);
+    if (!digests || !store.sections || !index) {
+        result = ERR_MEM;
+        goto free_buffers;
+    }
+
+    FILE* f = fopen(filename, "wb");
+    if (!f) {
+        result = ERR_FOPEN;
+        goto free_buffers;
+    }
+    // the packets go after the header and index, which we fill in once we
+    // know where each section went and their checksum
+    uint64_t offset = STORE_HEADER_SIZE + index_size;
+    if (fseek(f, offset, SEEK_SET) != 0) {
+        result = ERR_BWRITE;
+        goto close_file;
+    }
+
+    uint32_t body_crc;
+    if ((result = write_packets(f, &store, data, num_symbols, offset,
+                                index, digests, &body_crc)) < 0)
+        goto close_file;
+    if ((result = merkle_root(digests, store.num_sections,
+                              store.merkle_root)) < 0)
+        goto close_file;
+
+    uint8_t header[STORE_HEADER_SIZE];
+    pack_header(&store, body_crc, header);
+    uint32_t header_crc = crc32c(crc32c(0, header, STORE_HEADER_SIZE - 4),
+                                 index, index_size);
+    put_be(header + STORE_HEADER_SIZE - 4, header_crc, 4);
+    rewind(f);
+    if (fwrite(header, sizeof header, 1, f) != 1
+            || (index_size && fwrite(index, index_size, 1, f) != 1))
+        result = ERR_BWRITE;
+
+close_file:
+    if (fclose(f) != 0 && result == 0)
+        result = ERR_BWRITE;
+    if (result < 0)
+        remove(filename);
+free_buffers:
+    free(index);
+    free(store.sections);
+    free(digests);
+    return result;
+}
+
+store_s* store_open(const char* filename) {
+    struct stat st;
+    if (stat(filename, &st) != 0) {
+        log_err("Cannot find the store %s", filename);
+        return NULL;
+    }
+    store_s* store = calloc(1, sizeof *store);
+    if (!store) {
+        log_err("Out of memory for the store");
+        return NULL;
+    }
+    store->size = st.st_size;
+    if (store->size < STORE_HEADER_SIZE) {
+        log_err("%s is too short to be a store", filename);
+        goto free_store;
+    }
+    store->mapping = map_file_read(filename);
+    if (!store->mapping) {
+        log_err("Error mapping the store %s", filename);
+        goto free_store;
+    }
+
+    const uint8_t* h = (const uint8_t*)store->mapping;
+    if (memcmp(h, STORE_MAGIC, 8) != 0) {
+        log_err("%s is not a store", filename);
+        goto unmap;
+    }
+    int version = get_be(h + 8, 2);
+    if (version != STORE_VERSION) {
+        log_err("%s is a version %d store, we can only serve version %d",
+                filename, version, STORE_VERSION);
+        goto unmap;
+    }
+    store->wire.version = get_be(h + 10, 2);
+    store->wire.checksum = get_be(h + 12, 2);
+    store->wire.nonce = get_be(h + 16, 4);
+    store->blk_size = get_be(h + 20, 4);
+    store->section_size = get_be(h + 24, 4);
+    uint32_t num_sections = get_be(h + 28, 4);
+    store->filesize = get_be(h + 32, 8);
+    memcpy(store->merkle_root, h + 40, SHA256_SIZE);
+    uint32_t body_crc = get_be(h + 72, 4);
+
+    const uint64_t packets_at = STORE_HEADER_SIZE
+                                + (uint64_t)num_sections * STORE_INDEX_SIZE;
+    if (packets_at > store->size) {
+        log_err("The store %s is truncated", filename);
+        goto unmap;
+    }
+    uint32_t header_crc = crc32c(crc32c(0, h, STORE_HEADER_SIZE - 4),
+                                 h + STORE_HEADER_SIZE,
+                                 packets_at - STORE_HEADER_SIZE);
+    if (header_crc != get_be(h + STORE_HEADER_SIZE - 4, 4)) {
+        log_err("The header of the store %s is corrupt", filename);
+        goto unmap;
+    }
+    if (store->blk_size <= 0 || store->blk_size > MAX_BLOCK_SIZE
+            || store->section_size <= 0 || num_sections > INT32_MAX) {
+        log_err("The store %s has sizes we cannot serve", filename);
+        goto unmap;
+    }
+    store->num_sections = num_sections;
+
+    store->sections = malloc((num_sections + 1) * sizeof *store->sections);
+    if (!store->sections) {
+        log_err("Out of memory for the store index");
+        goto unmap;
+    }
+    for (int s = 0; s < store->num_sections; s++) {
+        const uint8_t* p = h + STORE_HEADER_SIZE + s * STORE_INDEX_SIZE;
+        store_section_s* sec = store->sections + s;
+        sec->offset = get_be(p, 8);
+        sec->num_symbols = get_be(p + 8, 4);
+        sec->packet_size = get_be(p + 12, 4);
+        if (sec->num_symbols == 0)
+            continue;
+        if (sec->packet_size < store->blk_size
+                || sec->packet_size > PACKED_FTN_SIZE(store->wire,
+                                                      store->blk_size)
+                || sec->offset < packets_at || sec->offset > store->size
+                || (store->size - sec->offset) / sec->packet_size
+                   < sec->num_symbols) {
+            log_err("Section %d of the store %s is out of bounds", s,
+                    filename);
+            goto free_sections;
+        }
+    }
+    // reads the whole store, but only the once
+    if (crc32c(0, h + packets_at, store->size - packets_at) != body_crc) {
+        log_err("The packets in the store %s are corrupt", filename);
+        goto free_sections;
+    }
+    return store;
+
+free_sections:
+    free(store->sections);
+unmap:
+    unmap_file(store->mapping);
+free_store:
+    free(store);
+    return NULL;
+}
+
+void store_close(store_s* store) {
+    if (!store) return;
+    unmap_file(store->mapping);
+    free(store->sections);
+    free(store);
+}
@@ -0,0 +1,75 @@
+#ifndef __STORE_H__
+#define __STORE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "fountain.h"   // ftn_wire_s
+#include "sha256.h"     // SHA256_SIZE
+
+/*
+ * A file of packets encoded ahead of time, for files that are served far more
+ * often than they change. The server sends them as they are, so the symbols a
+ * store holds cost no encoding or checksumming at all.
+ *
+ * Every section has the first num_symbols symbols of one stream, packed the
+ * way they go on the wire, one after the other. Multi-byte fields are
+ * big-endian:
+ *
+ *   "FTNSTORE" | version (u16) | wire version (u16) | checksum (u16) | 0 (u16) |
+ *   nonce (u32) | block size (u32) | section size (u32) | sections (u32) |
+ *   file size (u64) | Merkle root (32) | CRC32C of the packets (u32) |
+ *   CRC32C of everything before it and the index (u32) |
+ *   index, for each section:
+ *     offset of its first packet (u64) | num_symbols (u32) | packet size (u32)
+ *   packets
+ */
+#define STORE_MAGIC         "FTNSTORE"
+#define STORE_VERSION       1
+#define STORE_HEADER_SIZE   80
+#define STORE_INDEX_SIZE    16
+
+typedef struct store_section_s {
+    uint64_t offset;
+    uint32_t num_symbols;   /* so symbol ids 0 to num_symbols - 1 */
+    uint32_t packet_size;
+} store_section_s;
+
+typedef struct store_s {
+    char* mapping;
+    size_t size;
+    ftn_wire_s wire;        /* that every packet is packed with */
+    int blk_size;
+    int section_size;
+    int num_sections;
+    uint64_t filesize;
+    uint8_t merkle_root[SHA256_SIZE]; /* of the file the store was made from */
+    store_section_s* sections;
+} store_s;
+
+/*
+ * Encode the first num_symbols symbols of every section of data in the stream
+ * of nonce into a new store at filename
+ * returns 0 or an error code
+ */
+int store_write(const char* filename, const char* data, size_t length,
+                int blk_size, int section_size, int num_symbols,
+                uint32_t nonce);
+
+/* Map a store and check it through, NULL if it is not one we can serve */
+store_s* store_open(const char* filename) __malloc;
+void store_close(store_s* store);
+
+/* The packet of symbol_id in section, or NULL if the store does not have it */
+static inline const char* store_packet(store_s* store, int section,
+                                       uint32_t symbol_id, int* length) {
+    if (section >= store->num_sections)
+        return NULL;
+    const store_section_s* sec = store->sections + section;
+    if (symbol_id >= sec->num_symbols)
+        return NULL;
+    *length = sec->packet_size;
+    return store->mapping + sec->offset
+           + (size_t)symbol_id * sec->packet_size;
+}
+
+#endif /* __STORE_H__ */
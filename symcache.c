@@ -0,0 +1,206 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#ifndef _WIN32
+#   include <sys/mman.h>    // mmap madvise
+#endif
+
+#include "symcache.h"
+
+#define CACHE_LINE  64
+#define HUGE_PAGE   (2 * 1024 * 1024)
+#define NONE        -1
+
+typedef struct slot_s {
+    symcache_key_s key;
+    int32_t prev;   /* more recently used */
+    int32_t next;   /* less recently used */
+    int32_t chain;  /* next in the same bucket */
+} slot_s;
+
+struct symcache_s {
+    char* slab;
+    size_t slab_size;
+    int huge;       /* slab is on explicit huge pages */
+    size_t slot_size;
+    int num_slots;
+    slot_s* slots;
+    int32_t* buckets;
+    uint32_t mask;
+    int32_t newest;
+    int32_t oldest;
+    int num_used;
+    uint64_t hits;
+    uint64_t misses;
+};
+
+/*
+ * Explicit huge pages if there are any set aside, otherwise ask for the
+ * kernel to back the mapping with transparent ones
+ */
+static char* slab_alloc(symcache_s* cache, size_t size) {
+#ifdef _WIN32
+    cache->slab_size = size;
+    return malloc(size);
+#else
+    void* slab = MAP_FAILED;
+#   ifdef MAP_HUGETLB
+    size_t huge_size = (size + HUGE_PAGE - 1) & ~(size_t)(HUGE_PAGE - 1);
+    slab = mmap(NULL, huge_size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (slab != MAP_FAILED) {
+        cache->huge = 1;
+        cache->slab_size = huge_size;
+        return slab;
+    }
+#   endif
+    slab = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (slab == MAP_FAILED)
+        return NULL;
+#   ifdef MADV_HUGEPAGE
+    madvise(slab, size, MADV_HUGEPAGE);
+#   endif
+    cache->slab_size = size;
+    return slab;
+#endif
+}
+
+static void slab_free(symcache_s* cache) {
+#ifdef _WIN32
+    free(cache->slab);
+#else
+    munmap(cache->slab, cache->slab_size);
+#endif
+}
+
+symcache_s* symcache_new(size_t bytes, int slot_size) {
+    symcache_s* cache = calloc(1, sizeof *cache);
+    if (!cache) return NULL;
+
+    cache->slot_size = (slot_size + CACHE_LINE - 1) & ~(CACHE_LINE - 1);
+    size_t num_slots = bytes / cache->slot_size;
+    if (num_slots == 0 || num_slots > INT32_MAX / 2)
+        goto free_cache;
+    cache->num_slots = num_slots;
+
+    size_t num_buckets = 1;
+    while (num_buckets < num_slots) num_buckets <<= 1;
+    cache->mask = num_buckets - 1;
+
+    cache->slots = calloc(num_slots, sizeof *cache->slots);
+    cache->buckets = malloc(num_buckets * sizeof *cache->buckets);
+    if (!cache->slots || !cache->buckets)
+        goto free_tables;
+    for (size_t i = 0; i < num_buckets; i++)
+        cache->buckets[i] = NONE;
+    cache->newest = cache->oldest = NONE;
+
+    cache->slab = slab_alloc(cache, num_slots * cache->slot_size);
+    if (!cache->slab)
+        goto free_tables;
+    return cache;
+
+free_tables:
+    free(cache->buckets);
+    free(cache->slots);
+free_cache:
+    free(cache);
+    return NULL;
+}
+
+void symcache_free(symcache_s* cache) {
+    if (!cache) return;
+    slab_free(cache);
+    free(cache->buckets);
+    free(cache->slots);
+    free(cache);
+}
+
+static uint32_t key_hash(const symcache_key_s* key) {
+    uint64_t h = (uint64_t)key->nonce << 32 | key->symbol_id;
+    h ^= (uint64_t)key->section << 16 ^ (uint64_t)key->blk_size << 48;
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    return h ^ (h >> 31);
+}
+
+static int key_equal(const symcache_key_s* a, const symcache_key_s* b) {
+    return a->nonce == b->nonce && a->symbol_id == b->symbol_id
+        && a->section == b->section && a->blk_size == b->blk_size;
+}
+
+static void lru_unlink(symcache_s* cache, int32_t i) {
+    slot_s* slot = cache->slots + i;
+    if (slot->prev != NONE) cache->slots[slot->prev].next = slot->next;
+    else cache->newest = slot->next;
+    if (slot->next != NONE) cache->slots[slot->next].prev = slot->prev;
+    else cache->oldest = slot->prev;
+}
+
+static void lru_push(symcache_s* cache, int32_t i) {
+    slot_s* slot = cache->slots + i;
+    slot->prev = NONE;
+    slot->next = cache->newest;
+    if (cache->newest != NONE) cache->slots[cache->newest].prev = i;
+    cache->newest = i;
+    if (cache->oldest == NONE) cache->oldest = i;
+}
+
+static void bucket_remove(symcache_s* cache, int32_t i) {
+    int32_t* link = cache->buckets + (key_hash(&cache->slots[i].key)
+                                      & cache->mask);
+    while (*link != i && *link != NONE)
+        link = &cache->slots[*link].chain;
+    if (*link == i)
+        *link = cache->slots[i].chain;
+}
+
+static int32_t slot_find(symcache_s* cache, const symcache_key_s* key) {
+    int32_t i = cache->buckets[key_hash(key) & cache->mask];
+    while (i != NONE && !key_equal(&cache->slots[i].key, key))
+        i = cache->slots[i].chain;
+    return i;
+}
+
+int symcache_contains(symcache_s* cache, const symcache_key_s* key) {
+    return slot_find(cache, key) != NONE;
+}
+
+void* symcache_get(symcache_s* cache, const symcache_key_s* key) {
+    int32_t i = slot_find(cache, key);
+    if (i == NONE) {
+        cache->misses++;
+        return NULL;
+    }
+    cache->hits++;
+    if (cache->newest != i) {
+        lru_unlink(cache, i);
+        lru_push(cache, i);
+    }
+    return cache->slab + (size_t)i * cache->slot_size;
+}
+
+void* symcache_put(symcache_s* cache, const symcache_key_s* key) {
+    int32_t i;
+    if (cache->num_used < cache->num_slots) {
+        i = cache->num_used++;
+    } else {
+        i = cache->oldest;
+        lru_unlink(cache, i);
+        bucket_remove(cache, i);
+    }
+    slot_s* slot = cache->slots + i;
+    slot->key = *key;
+    int32_t* bucket = cache->buckets + (key_hash(key) & cache->mask);
+    slot->chain = *bucket;
+    *bucket = i;
+    lru_push(cache, i);
+    return cache->slab + (size_t)i * cache->slot_size;
+}
+
+void symcache_stats(symcache_s* cache, uint64_t* hits, uint64_t* misses) {
+    *hits = cache->hits;
+    *misses = cache->misses;
+}
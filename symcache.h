@@ -0,0 +1,42 @@
+#ifndef __SYMCACHE_H__
+#define __SYMCACHE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "platform.h"
+
+/*
+ * A fixed size cache of encoded symbols, so that a symbol many clients are
+ * sent is only encoded once.
+ *
+ * Symbols are picked out by everything that goes into encoding them and
+ * live in equal slots of a slab allocated up front, on huge pages where the
+ * system lets us. Once every slot is taken the least recently used is
+ * given to the next symbol put in.
+ */
+typedef struct symcache_s symcache_s;
+
+typedef struct symcache_key_s {
+    uint32_t nonce;
+    uint32_t symbol_id;
+    uint32_t section;
+    uint32_t blk_size;
+} symcache_key_s;
+
+/* as many slot_size slots as fit in bytes, NULL if that is none */
+symcache_s* symcache_new(size_t bytes, int slot_size) __malloc;
+void symcache_free(symcache_s* cache);
+
+/* returns the slot holding the symbol or NULL if it is not cached */
+void* symcache_get(symcache_s* cache, const symcache_key_s* key);
+
+/* whether the symbol is cached, without it counting as a get */
+int symcache_contains(symcache_s* cache, const symcache_key_s* key);
+
+/* returns the slot to put the symbol in, for it to be found from now on */
+void* symcache_put(symcache_s* cache, const symcache_key_s* key);
+
+/* how many gets found their symbol and how many did not */
+void symcache_stats(symcache_s* cache, uint64_t* hits, uint64_t* misses);
+
+#endif /* __SYMCACHE_H__ */
@@ -52,3 +52,96 @@ for bs in 128 256 512 1024; do
 done
 
 
+
+echo
+echo Store test:
+cp $testfile $input
+rm -f $output
+../fountain -f $input -S test.store >/dev/null 2>store-make.log
+../server --store=test.store $input 2>server-store.log &
+server_pid=$!
+sleep 0.5
+../client --output=$output 2>client-store.log
+sleep 0.2   # for the server to take the client's last done signal
+kill $server_pid
+if [[ -r $output && -z "$(cmp $input $output)" ]] \
+        && grep -qE "Sent [1-9][0-9]* packets from the store" server-store.log; then
+    echo "    ::: PASSED ::: The files match, sent from the store"
+    rm -f store-make.log server-store.log client-store.log
+else
+    echo "    ::: FAILED ::: $input and $output do not match"
+fi
+rm -f $input $output test.store
+
+echo Ring test:
+cp $testfile $input
+rm -f $output ring.sock
+../server --unix=ring.sock $input 2>server-ring.log &
+server_pid=$!
+sleep 0.5
+../client --unix=ring.sock --output=$output 2>client-ring.log
+sleep 0.2   # for the server to take the client's last done signal
+kill $server_pid
+if [[ -r $output && -z "$(cmp $input $output)" ]] \
+        && grep -qE "Put [1-9][0-9]* packets in shared memory rings" server-ring.log; then
+    echo "    ::: PASSED ::: The files match, sent through a ring"
+    rm -f server-ring.log client-ring.log
+else
+    echo "    ::: FAILED ::: $input and $output do not match"
+fi
+rm -f $input $output ring.sock
+
+# Pass datagrams between a client at port $1 and a server at port $2,
+# dropping the first $3 the client sends
+udp_relay() {
+    python3 - "$@" <<'EOF' &
+import select, socket, sys
+front, back, drop = int(sys.argv[1]), int(sys.argv[2]), int(sys.argv[3])
+f = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+f.bind(('127.0.0.1', front))
+b = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+b.connect(('127.0.0.1', back))
+client = None
+while True:
+    readable = select.select([f, b], [], [])[0]
+    if f in readable:
+        data, client = f.recvfrom(65536)
+        if drop > 0:
+            drop -= 1
+        else:
+            b.send(data)
+    if b in readable:
+        f.sendto(b.recv(65536), client)
+EOF
+    relay_pid=$!
+}
+
+echo
+echo Unanswered info request test:
+cp $testfile $input
+rm -f $output
+../server --port=7601 $input 2>server-unanswered.log &
+server_pid=$!
+udp_relay 7600 7601 2
+sleep 0.5
+timeout 60 ../client --port=7600 --output=$output 2>client-unanswered.log
+kill $server_pid $relay_pid
+if [[ -r $output && -z "$(cmp $input $output)" ]]; then
+    echo "    ::: PASSED ::: The files match, the client asked again"
+    rm -f server-unanswered.log client-unanswered.log
+else
+    echo "    ::: FAILED ::: $input and $output do not match"
+fi
+# and with no answer at all it gives up rather than wait forever
+udp_relay 7602 7603 1000000
+sleep 0.5
+timeout 60 ../client --port=7602 --output=$output 2>client-unanswered.log
+result=$?
+kill $relay_pid
+if [[ $result -ne 0 && $result -ne 124 ]]; then
+    echo "    ::: PASSED ::: The client gave up on a silent server"
+    rm -f client-unanswered.log
+else
+    echo "    ::: FAILED ::: The client exited with $result"
+fi
+rm -f $input $output
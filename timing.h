@@ -0,0 +1,32 @@
+#ifndef __TIMING_H__
+#define __TIMING_H__
+
+#include <stdint.h>
+#ifdef _WIN32
+#   define WIN32_LEAN_AND_MEAN
+#   include <windows.h>
+#else
+#   include <time.h>
+#endif
+
+/*
+ * A monotonic clock in microseconds. Used for pacing and for measuring the
+ * delays between requests and packets, where wall clock jumps would hurt us.
+ */
+static inline uint64_t monotonic_usec(void)
+{
+#ifdef _WIN32
+    static LARGE_INTEGER freq = { };
+    LARGE_INTEGER count;
+    if (!freq.QuadPart)
+        QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return (uint64_t)(count.QuadPart * 1000000.0 / freq.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+#endif
+}
+
+#endif /* __TIMING_H__ */